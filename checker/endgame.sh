@@ -0,0 +1,103 @@
+#!/bin/bash
+
+# Verifica numarul de segmente duplicate primite in endgame: fiecare segment
+# cerut din nou in endgame poate aduce cel mult ENDGAME_COPIES - 1 copii in
+# plus, iar fiecare segment cerut din nou dupa un timeout cel mult una.
+
+correct=0
+total=0
+
+copies=$(grep "#define ENDGAME_COPIES" ../src/constants.h | awk '{print $3}')
+
+# afiseaza scorul final
+function show_score {
+	echo "Total: $correct/$total"
+}
+
+# se ruleaza un test cu statisticile activate (parametri: test procese variabile...)
+function run_stats {
+    test=$1
+    np=$2
+    shift 2
+
+    echo "Se ruleaza $test cu $* ..."
+    cp tests/$test/* .
+    total=$((total+1))
+
+    env BT_STATS=1 "$@" timeout 20 mpirun --oversubscribe -np $np ./tema2 2> stats.txt > /dev/null
+    ret=$?
+
+    if [ $ret == 124 ]
+    then
+        echo "W: Programul a durat mai mult de 20 de secunde"
+    elif [ $ret != 0 ]
+    then
+        echo "W: Rularea nu s-a putut executa cu succes"
+    else
+        ok=1
+        while read line
+        do
+            client=$(echo "$line" | awk '{print $2}')
+            positions=$(echo "$line" | sed 's/.* for \([0-9]*\) segments.*/\1/')
+            duplicates=$(echo "$line" | sed 's/.* \([0-9]*\) duplicate segments.*/\1/')
+            requeued=$(echo "$line" | sed 's/.*(\([0-9]*\) segments asked again).*/\1/')
+            limit=$(((copies-1)*positions+requeued))
+
+            if [ $duplicates -gt $limit ]
+            then
+                echo "W: Clientul $client a primit $duplicates segmente duplicate (maxim $limit)"
+                ok=0
+            fi
+        done < <(grep "endgame:" stats.txt)
+
+        if [ $ok == 1 ]
+        then
+            correct=$((correct+1))
+            echo "OK"
+        fi
+    fi
+
+    rm -rf stats.txt
+    rm -rf client*_file*
+    rm -rf in*txt
+    rm -rf out*txt
+    echo ""
+}
+
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+
+# se compileaza tema
+cd ../src
+make clean &> /dev/null
+make build &> build.txt
+
+if [ ! -f tema2 ]
+then
+    echo "E: Nu s-a putut compila tema"
+    cat build.txt
+    rm -rf build.txt
+    exit 1
+fi
+
+rm -rf build.txt
+
+mv tema2 ../checker
+cd ../checker
+
+echo ""
+for env in "BT_ENDGAME_THRESHOLD=4" "BT_UPLOAD_RATE=50 BT_UPLOAD_BURST=1"
+do
+    run_stats test1 4 $env
+    run_stats test2 6 $env
+    run_stats test3 5 $env
+    run_stats test4 7 $env
+done
+
+rm -rf tema2
+cd ../src
+make clean &> /dev/null
+cd ../checker
+
+show_score
+[ $correct == $total ]
@@ -0,0 +1,156 @@
+#!/bin/bash
+
+# Ruleaza testele cu datele segmentelor transferate si verificate
+# (BT_PAYLOAD=1, BT_VERIFY=1). Hash-urile din fisierele de intrare sunt
+# inlocuite cu MD5-urile datelor generate de clienti (fiecare segment umplut
+# cu octetul indicelui sau), astfel incat verificarea sa reuseasca.
+
+correct=0
+total=0
+
+size=4096
+
+# afiseaza scorul final
+function show_score {
+	echo "Total: $correct/$total"
+}
+
+# MD5-ul unui segment umplut cu octetul k, pentru k = 0 .. 255
+function generate_hashes {
+    rm -rf hashes.txt
+    for k in $(seq 0 255)
+    do
+        head -c $size /dev/zero | tr '\0' "\\$(printf '%03o' $k)" | md5sum | cut -d ' ' -f 1 >> hashes.txt
+    done
+}
+
+# inlocuieste hash-urile unui fisier de intrare si scrie fisierele out*.txt
+# asteptate (parametru: fisier)
+function rewrite_input {
+    awk -v input=$1 '
+        NR == FNR { hashes[FNR - 1] = $1; next }
+        FNR == 1 { files = $1; done = 0; print > (input ".new"); next }
+        left > 0 {
+            print hashes[(cnt - left) % 256] > (input ".new")
+            print hashes[(cnt - left) % 256] > out
+            left--
+            next
+        }
+        done < files && NF == 2 {
+            cnt = $2; left = cnt; done++
+            out = "out" substr($1, 5) ".txt"
+            printf "" > out
+            print > (input ".new")
+            next
+        }
+        { print > (input ".new") }
+    ' hashes.txt $1
+    mv $1.new $1
+}
+
+# se ruleaza un test (parametri: test procese variabile...)
+function run_verified {
+    test=$1
+    np=$2
+    shift 2
+
+    echo "Se ruleaza $test cu $* ..."
+    cp tests/$test/in*.txt .
+    rm -rf out*.txt
+    for input in in*.txt
+    do
+        rewrite_input $input
+    done
+    total=$((total+1))
+
+    env BT_PAYLOAD=1 BT_VERIFY=1 BT_SEGMENT_SIZE=$size "$@" timeout 20 mpirun --oversubscribe -np $np ./tema2 &> run.txt
+    ret=$?
+
+    if [ $ret == 124 ]
+    then
+        echo "W: Programul a durat mai mult de 20 de secunde"
+    elif [ $ret != 0 ]
+    then
+        echo "W: Rularea nu s-a putut executa cu succes"
+        grep -v "^\[client" run.txt | head -5
+    else
+        ok=1
+
+        # hash-urile scrise de clienti
+        for output in $(ls client*_file* | grep -v "\.data$")
+        do
+            diff -q -w $output out${output##*_file}.txt > /dev/null
+            if [ $? != 0 ]
+            then
+                echo "W: Exista diferente intre fisierele $output si out${output##*_file}.txt"
+                ok=0
+            fi
+        done
+
+        # datele fiecarui fisier sunt aceleasi la toti clientii
+        for data in client*_file*.data
+        do
+            name=${data#*_}
+            first=$(ls client*_$name | head -1)
+            cmp -s $data $first
+            if [ $? != 0 ]
+            then
+                echo "W: Exista diferente intre fisierele $data si $first"
+                ok=0
+            fi
+        done
+
+        if [ $ok == 1 ]
+        then
+            correct=$((correct+1))
+            echo "OK"
+        fi
+    fi
+
+    rm -rf run.txt
+    rm -rf client*_file*
+    rm -rf in*txt
+    rm -rf out*txt
+    echo ""
+}
+
+export OMPI_ALLOW_RUN_AS_ROOT=1
+export OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1
+
+# se compileaza tema
+cd ../src
+make clean &> /dev/null
+make build &> build.txt
+
+if [ ! -f tema2 ]
+then
+    echo "E: Nu s-a putut compila tema"
+    cat build.txt
+    rm -rf build.txt
+    exit 1
+fi
+
+rm -rf build.txt
+
+mv tema2 ../checker
+cd ../checker
+
+generate_hashes
+
+echo ""
+for env in "BT_VERIFIERS=2" "BT_UPLOAD_RATE=50 BT_UPLOAD_BURST=1"
+do
+    run_verified test1 4 $env
+    run_verified test2 6 $env
+    run_verified test3 5 $env
+    run_verified test4 7 $env
+done
+
+rm -rf hashes.txt
+rm -rf tema2
+cd ../src
+make clean &> /dev/null
+cd ../checker
+
+show_score
+[ $correct == $total ]
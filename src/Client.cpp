@@ -5,22 +5,172 @@
 #include <limits.h>
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <numeric>
+#include <list>
+#include <unistd.h>
+#include <cstring>
+#include <fcntl.h>
+#include <charconv>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "md5.h"
 #include "constants.h"
 
 using namespace std;
 
 
-Client::Client(int numtasks, int rank) {
+Client::Client(int numtasks, int rank, int trackers) {
     this->numtasks = numtasks;
+    this->trackers = trackers;
     this->rank = rank;
-    this->load = 0;
+    this->load.store(0);
+    this->print_stats = getenv("BT_STATS") != NULL;
+    this->stops_received = 0;
+    this->bitfields_pending = 0;
+
+    this->pex = PEX;
+    if (getenv("BT_PEX") != NULL) {
+        this->pex = atoi(getenv("BT_PEX")) != 0;
+    }
+
+    // With the replica index, the owners come from the tracker, not from the swarm.
+    this->replica_index = REPLICA_INDEX;
+    if (getenv("BT_REPLICA_INDEX") != NULL) {
+        this->replica_index = atoi(getenv("BT_REPLICA_INDEX")) != 0;
+    }
+    if (this->replica_index) {
+        this->pex = false;
+    }
+    this->rng.seed(rank);
+
+    this->endgame_threshold = ENDGAME_THRESHOLD;
+    if (getenv("BT_ENDGAME_THRESHOLD") != NULL) {
+        this->endgame_threshold = max(0, atoi(getenv("BT_ENDGAME_THRESHOLD")));
+    }
+
+    this->peer_window = PEER_WINDOW;
+    if (getenv("BT_PEER_WINDOW") != NULL) {
+        this->peer_window = max(1, atoi(getenv("BT_PEER_WINDOW")));
+    }
+
+    this->payload = PAYLOAD;
+    if (getenv("BT_PAYLOAD") != NULL) {
+        this->payload = atoi(getenv("BT_PAYLOAD")) != 0;
+    }
+
+    this->segment_size = SEGMENT_SIZE;
+    if (getenv("BT_SEGMENT_SIZE") != NULL) {
+        this->segment_size = max(1, atoi(getenv("BT_SEGMENT_SIZE")));
+    }
+
+    // Only the actual bytes of the segments can be verified.
+    this->verify = VERIFY;
+    if (getenv("BT_VERIFY") != NULL) {
+        this->verify = atoi(getenv("BT_VERIFY")) != 0;
+    }
+    if (!this->payload) {
+        this->verify = false;
+    }
+
+    this->verifiers = VERIFIERS;
+    if (getenv("BT_VERIFIERS") != NULL) {
+        this->verifiers = max(1, atoi(getenv("BT_VERIFIERS")));
+    }
+    this->verify_stopping = false;
+    this->verifications = 0;
+    this->hashed_segments = 0;
+    this->hashing_time = 0;
+
+    this->segment_batch = SEGMENT_BATCH;
+    if (getenv("BT_SEGMENT_BATCH") != NULL) {
+        this->segment_batch = max(1, atoi(getenv("BT_SEGMENT_BATCH")));
+    }
+
+    int global_window = GLOBAL_WINDOW;
+    if (getenv("BT_GLOBAL_WINDOW") != NULL) {
+        global_window = max(1, atoi(getenv("BT_GLOBAL_WINDOW")));
+    }
+
+    // Each slot has its own reply and data tags, which must not overlap.
+    if (global_window > MAX_GLOBAL_WINDOW) {
+        cerr << "BT_GLOBAL_WINDOW is clamped to " << MAX_GLOBAL_WINDOW << ".\n";
+        global_window = MAX_GLOBAL_WINDOW;
+    }
+
+    this->max_sessions = MAX_SESSIONS;
+    if (getenv("BT_SESSIONS") != NULL) {
+        this->max_sessions = max(1, atoi(getenv("BT_SESSIONS")));
+    }
+
+    this->slots.resize(global_window);
+    this->reply_requests.resize(global_window, MPI_REQUEST_NULL);
+    for (int slot = global_window - 1; slot >= 0; slot--) {
+        this->free_slots.push_back(slot);
+    }
+    this->in_flight = 0;
+
+    this->upload_workers = UPLOAD_WORKERS;
+    if (getenv("BT_UPLOAD_WORKERS") != NULL) {
+        this->upload_workers = max(1, atoi(getenv("BT_UPLOAD_WORKERS")));
+    }
+    this->upload_stopping = false;
+
+    this->choke = CHOKE_SCHEDULER;
+    if (getenv("BT_CHOKE") != NULL) {
+        this->choke = atoi(getenv("BT_CHOKE")) != 0;
+    }
+
+    this->unchoke_slots = UNCHOKE_SLOTS;
+    if (getenv("BT_UNCHOKE_SLOTS") != NULL) {
+        this->unchoke_slots = max(1, atoi(getenv("BT_UNCHOKE_SLOTS")));
+    }
 
-    pthread_mutex_init(&owned_files_mutex, NULL);
+    this->upload_rate = UPLOAD_RATE;
+    if (getenv("BT_UPLOAD_RATE") != NULL) {
+        this->upload_rate = max(0.0, atof(getenv("BT_UPLOAD_RATE")));
+    }
+
+    double upload_burst = UPLOAD_BURST;
+    if (getenv("BT_UPLOAD_BURST") != NULL) {
+        upload_burst = max(1.0, atof(getenv("BT_UPLOAD_BURST")));
+    }
+
+    this->received_from = vector<atomic<int>>(numtasks);
+    this->served_to = vector<atomic<int>>(numtasks);
+    this->upload_peers.resize(numtasks);
+    for (auto &peer : this->upload_peers) {
+        peer.bucket = TokenBucket(this->upload_rate, upload_burst);
+    }
+    this->optimistic_peer = -1;
+    this->next_rechoke = 0;
+    this->farewells_pending = 0;
+    this->download_time = 0;
+
+    pthread_mutex_init(&subscribers_mutex, NULL);
+    pthread_mutex_init(&upload_jobs_mutex, NULL);
+    pthread_cond_init(&upload_jobs_cond, NULL);
+    pthread_mutex_init(&verify_mutex, NULL);
+    pthread_cond_init(&verify_cond, NULL);
 }
 
 
 Client::~Client() {
-    pthread_mutex_destroy(&owned_files_mutex);
+    pthread_mutex_destroy(&subscribers_mutex);
+    pthread_mutex_destroy(&upload_jobs_mutex);
+    pthread_cond_destroy(&upload_jobs_cond);
+    pthread_mutex_destroy(&verify_mutex);
+    pthread_cond_destroy(&verify_cond);
+
+    for (auto &bitfield : owned_segments) {
+        delete bitfield.load();
+    }
+
+    for (int file = 0; file < (int) file_data.size(); file++) {
+        if (file_data[file].load() != NULL) {
+            munmap(file_data[file].load(), file_data_sizes[file]);
+        }
+    }
 }
 
 
@@ -55,17 +205,28 @@ void Client::run() {
         printf("Eroare la asteptarea thread-ului de upload\n");
         exit(-1);
     }
+
+    // The first tracker reports how evenly the segments were served, and the
+    // throughput of the whole swarm.
+    if (this->print_stats) {
+        double report[3] = {(double) this->load.load(), (double) this->stats.received_segments,
+                            this->download_time};
+        MPI_Gather(report, 3, MPI_DOUBLE, NULL, 0, MPI_DOUBLE, TRACKER_RANK, MPI_COMM_WORLD);
+    }
 }
 
 
 void Client::initialize() {
     read_input_file();
 
+    // The files are known by their IDs from here on.
     send_owned_files_to_tracker();
 
-    // Wait for ACK from the tracker.
+    init_owned_segments();
+
+    // Wait for the start signal (ACK) from the tracker.
     int msg;
-    MPI_Recv(&msg, 1, MPI_INT, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    MPI_Bcast(&msg, 1, MPI_INT, TRACKER_RANK, MPI_COMM_WORLD);
 
     if (msg != ACK) {
         cerr << "Did not receive ACK from the tracker.\n";
@@ -74,361 +235,2417 @@ void Client::initialize() {
 }
 
 
+static bool is_space(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+
+/*
+ * Next whitespace-delimited token of the mapped input, in place: pos is moved
+ * past it. Returns false at the end of the input.
+ */
+static bool next_token(const char *&pos, const char *end, const char *&token, size_t &len) {
+    while (pos < end && is_space(*pos)) {
+        pos++;
+    }
+
+    token = pos;
+    while (pos < end && !is_space(*pos)) {
+        pos++;
+    }
+
+    len = pos - token;
+    return len > 0;
+}
+
+
+/*
+ * Next token of the mapped input as a hash: HASH_SIZE hex digits, decoded in
+ * place. Its end is checked directly instead of scanning for it.
+ */
+static bool next_hash(const char *&pos, const char *end, Digest &digest) {
+    while (pos < end && is_space(*pos)) {
+        pos++;
+    }
+
+    if (end - pos < HASH_SIZE || (end - pos > HASH_SIZE && !is_space(pos[HASH_SIZE]))
+        || !hex_to_digest(pos, HASH_SIZE, digest)) {
+        return false;
+    }
+
+    pos += HASH_SIZE;
+    return true;
+}
+
+
+static int next_count(const char *&pos, const char *end, const string &in_file_name) {
+    const char *token;
+    size_t len;
+    int value = -1;
+
+    if (!next_token(pos, end, token, len) || from_chars(token, token + len, value).ptr != token + len
+        || value < 0) {
+        cerr << "Invalid count in " << in_file_name << ".\n";
+        exit(-1);
+    }
+
+    return value;
+}
+
+
+static string next_name(const char *&pos, const char *end, const string &in_file_name) {
+    const char *token;
+    size_t len;
+
+    if (!next_token(pos, end, token, len)) {
+        cerr << "Missing file name in " << in_file_name << ".\n";
+        exit(-1);
+    }
+
+    return string(token, len);
+}
+
+
+/*
+ * Parses in<rank>.txt straight from a read-only mapping of it: the tokens are
+ * delimited in place and the hashes are decoded from the mapped bytes, so only
+ * the file names are copied.
+ */
 void Client::read_input_file() {
+    double start = MPI_Wtime();
     string in_file_name = "in" + to_string(this->rank) + ".txt";
-    ifstream input_file(in_file_name);
+
+    int fd = open(in_file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "Could not open " << in_file_name << ".\n";
+        exit(-1);
+    }
+
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    size_t size = file_stat.st_size;
+
+    const char *data = "";
+    if (size > 0) {
+        data = (const char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            cerr << "Could not map " << in_file_name << ".\n";
+            exit(-1);
+        }
+        madvise((void *) data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    const char *pos = data;
+    const char *end = data + size;
+    long total_segments = 0;
 
     // Read owned files.
-    int owned_files_cnt;
-    input_file >> owned_files_cnt;
+    int owned_files_cnt = next_count(pos, end, in_file_name);
 
     for (int i = 0; i < owned_files_cnt; i++) {
-        string file_name;
-        int segment_cnt;
+        string file_name = next_name(pos, end, in_file_name);
+        int segment_cnt = next_count(pos, end, in_file_name);
 
-        input_file >> file_name;
-        input_file >> segment_cnt;
+        // The hashes are decoded straight into the segment table, and kept
+        // in binary form from here on.
+        this->input_files.emplace_back(file_name, SegmentTable());
+        SegmentTable &segments = this->input_files.back().second;
+        segments.indices.resize(segment_cnt);
+        segments.digests.resize(segment_cnt);
+        iota(segments.indices.begin(), segments.indices.end(), 0);
 
         for (int idx = 0; idx < segment_cnt; idx++) {
-            string segment_hash;
-            input_file >> segment_hash;
-
-            this->owned_files[file_name].emplace_back(segment_hash, idx);
+            if (!next_hash(pos, end, segments.digests[idx])) {
+                cerr << "Invalid hash for segment " << idx << " of " << file_name << ".\n";
+                exit(-1);
+            }
         }
+
+        total_segments += segment_cnt;
     }
 
     // Read wanted files.
-    int wanted_files_cnt;
-    input_file >> wanted_files_cnt;
+    int wanted_files_cnt = next_count(pos, end, in_file_name);
 
     for (int i = 0; i < wanted_files_cnt; i++) {
-        string file_name;
-        input_file >> file_name;
+        this->wanted_files.push_back(next_name(pos, end, in_file_name));
+    }
 
-        this->wanted_files.insert(file_name);
+    if (size > 0) {
+        munmap((void *) data, size);
     }
 
-    input_file.close();
+    if (this->print_stats) {
+        double elapsed = MPI_Wtime() - start;
+        cerr << "[client " << this->rank << "] manifest: " << total_segments << " segments of "
+             << owned_files_cnt << " files parsed in " << elapsed << " s ("
+             << size / max(elapsed, 1e-9) / 1e6 << " MB/s)\n";
+    }
 }
 
 
-void Client::send_owned_files_to_tracker() {
-    // Send the files count.
-    int owned_files_cnt = owned_files.size();
-    MPI_Send(&owned_files_cnt, 1, MPI_INT, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD);
+void Client::init_owned_segments() {
+    for (int file = 0; file < this->file_cnt; file++) {
+        this->owned_segments[file].store(NULL);
+        this->file_data[file].store(NULL);
+
+        // Only the owned files have a name yet.
+        if (this->file_names[file].empty()) {
+            continue;
+        }
+
+        const SegmentTable &segments = this->owned_files[file];
+        Bitfield *bitfield = new Bitfield(segments.size());
+        bitfield->set_all();
+
+        this->owned_segments[file].store(bitfield);
+        this->file_data[file].store(this->payload ? map_file_data(file, segments.size(), true) : NULL);
+    }
+}
+
+
+/*
+ * Maps the data of a file (client<rank>_<file>.data, one segment_size block
+ * per segment) in memory. The data of an owned file is generated if it is
+ * missing; the data of a wanted file is only allocated, to be received in place.
+ */
+char *Client::map_file_data(int file, int segment_cnt, bool fill) {
+    string path = "client" + to_string(this->rank) + "_" + this->file_names[file] + ".data";
+    size_t size = max((size_t) 1, segment_cnt * this->segment_size);
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        cerr << "Could not open " << path << ".\n";
+        exit(-1);
+    }
 
-    for (const auto &[file, segments] : owned_files) {
-        // Send file name (including '\0').
-        MPI_Send(file.c_str(), file.size() + 1, MPI_CHAR, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD);
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    bool generate = fill && (size_t) file_stat.st_size != size;
+
+    if (ftruncate(fd, size) != 0) {
+        cerr << "Could not allocate " << path << ".\n";
+        exit(-1);
+    }
 
-        // Send segment count.
-        int segments_cnt = segments.size();
-        MPI_Send(&segments_cnt, 1, MPI_INT, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD);
+    char *data = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
 
-        for (const auto &segment : segments) {
-            // Send segment hash.
-            MPI_Send(segment.hash.c_str(), HASH_SIZE, MPI_CHAR, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD);
+    if (data == MAP_FAILED) {
+        cerr << "Could not map " << path << ".\n";
+        exit(-1);
+    }
 
-            // Send segment index.
-            MPI_Send(&segment.index, 1, MPI_INT, TRACKER_RANK, INIT_TAG, MPI_COMM_WORLD);
+    // Synthetic content: each segment filled with a byte of its own.
+    if (generate) {
+        for (int idx = 0; idx < segment_cnt; idx++) {
+            memset(data + idx * this->segment_size, idx & 0xff, this->segment_size);
         }
     }
+
+    this->file_data_sizes[file] = size;
+    return data;
 }
 
 
-void *download_thread_func(void *arg) {
-    Client *client = (Client*) arg;
+/*
+ * Datatype of some segments of a mapped file, given as (first index, count)
+ * ranges: the bytes are sent from (and received into) their place in the
+ * mapping, without any intermediate buffer.
+ */
+MPI_Datatype Client::segments_datatype(const std::vector<int> &ranges) {
+    int ranges_cnt = ranges.size() / 2;
+
+    vector<int> lengths(ranges_cnt);
+    vector<MPI_Aint> displs(ranges_cnt);
+    for (int i = 0; i < ranges_cnt; i++) {
+        displs[i] = (MPI_Aint) ranges[2 * i] * this->segment_size;
+        lengths[i] = ranges[2 * i + 1] * this->segment_size;
+    }
 
-    for (const auto &wanted_file : client->wanted_files) {
-        vector<int> swarm;
-        vector<Segment> segments;
-        client->receive_file_details_from_tracker(wanted_file, swarm, segments);
+    MPI_Datatype type;
+    MPI_Type_create_hindexed(ranges_cnt, lengths.data(), displs.data(), MPI_BYTE, &type);
+    MPI_Type_commit(&type);
 
-        int segment_counter = 0;
+    return type;
+}
 
-        // Ask peers for segments.
-        for (auto segment : segments) {
-            segment_counter++;
-            if (segment_counter == 10) {
-                segment_counter = 0;
-                client->update_swarm_from_tracker(wanted_file, swarm);
-            }
 
-            // Get the peer from the swarm that owns the segment and has minimum load.
-            int peer = client->get_peer_with_min_load_for_segment(wanted_file, segment.index, swarm);
+void Client::send_owned_files_to_tracker() {
+    // Serialize one manifest for each tracker, with the files of its
+    // partition: the files count, then, for each file, its name and its
+    // segment table.
+    vector<Message> manifests(this->trackers);
+    vector<vector<int>> manifest_files(this->trackers);
+
+    for (int i = 0; i < (int) this->input_files.size(); i++) {
+        manifest_files[tracker_of(this->input_files[i].first, this->trackers)].push_back(i);
+    }
 
-            // Send "Hello" message to that peer, initialising a GET_SEGMENT communication.
-            int msg = GET_SEGMENT_REQ;
-            MPI_Send(&msg, 1, MPI_INT, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+    for (int tracker = 0; tracker < this->trackers; tracker++) {
+        Message &manifest = manifests[tracker];
+        manifest.append_int(manifest_files[tracker].size());
 
-            // Send file name (including '\0').
-            MPI_Send(wanted_file.c_str(), wanted_file.size() + 1, MPI_CHAR, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+        for (int i : manifest_files[tracker]) {
+            manifest.append_string(this->input_files[i].first);
+            manifest.append_segment_table(this->input_files[i].second);
+        }
+    }
 
-            // Send segment index.
-            MPI_Send(&segment.index, 1, MPI_INT, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+    // Each tracker collects the sizes first, then all the manifests at once,
+    // and sends back the number of files it knows and the ID of each file of
+    // the manifest.
+    vector<vector<int>> ids(this->trackers);
+    int max_tracker_files = 0;
 
-            // Receive response (simulate the receival of the segment).
-            int response;
-            MPI_Recv(&response, 1, MPI_INT, peer, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    for (int tracker = 0; tracker < this->trackers; tracker++) {
+        Message &manifest = manifests[tracker];
 
-            if (response != ACK) {
-                cerr << "Critical: segment was not correctly received.\n";
-                exit(-1);
-            }
+        int manifest_size = manifest.payload.size();
+        MPI_Gather(&manifest_size, 1, MPI_INT, NULL, 0, MPI_INT, tracker, MPI_COMM_WORLD);
+
+        MPI_Gatherv(manifest.payload.data(), manifest_size, MPI_BYTE, NULL, NULL, NULL, MPI_BYTE,
+                    tracker, MPI_COMM_WORLD);
+
+        ids[tracker].resize(1 + manifest_files[tracker].size());
+        MPI_Scatterv(NULL, NULL, NULL, MPI_INT, ids[tracker].data(), ids[tracker].size(), MPI_INT,
+                     tracker, MPI_COMM_WORLD);
+
+        max_tracker_files = max(max_tracker_files, ids[tracker][0]);
+    }
+
+    // The IDs of the trackers are interleaved, so they are all below this.
+    this->file_cnt = max_tracker_files * this->trackers;
+
+    this->file_names.resize(this->file_cnt);
+    this->owned_files.resize(this->file_cnt);
+    this->owned_segments = vector<atomic<Bitfield *>>(this->file_cnt);
+    this->file_data = vector<atomic<char *>>(this->file_cnt);
+    this->file_data_sizes.resize(this->file_cnt, 0);
+    this->subscribers.resize(this->file_cnt);
+    this->subscribers_versions = vector<atomic<int>>(this->file_cnt);
+    this->downloading.resize(this->file_cnt, false);
+    this->availability.resize(this->file_cnt);
+    this->stale_swarms.resize(this->file_cnt, false);
+    this->discovered.resize(this->file_cnt);
+    this->who_has_pending.resize(this->file_cnt, false);
+    this->who_has_time.resize(this->file_cnt, 0);
+    this->who_has_rounds.resize(this->file_cnt, 0);
+
+    for (int tracker = 0; tracker < this->trackers; tracker++) {
+        for (size_t k = 0; k < manifest_files[tracker].size(); k++) {
+            int file = ids[tracker][1 + k];
+            auto &[file_name, segments] = this->input_files[manifest_files[tracker][k]];
+
+            this->file_names[file] = move(file_name);
+            this->owned_files[file] = move(segments);
+        }
+    }
 
-            // Add the "newly received" segment to the owned list.
-            pthread_mutex_lock(&client->owned_files_mutex);
-            client->owned_files[wanted_file].emplace_back(segment.hash, segment.index);
-            pthread_mutex_unlock(&client->owned_files_mutex);
+    this->input_files.clear();
+}
+
+
+void *download_thread_func(void *arg) {
+    Client *client = (Client*) arg;
+
+    // The received segments are hashed by a pool of verifiers, off this thread.
+    vector<pthread_t> verifiers(client->verify ? client->verifiers : 0);
+    for (auto &verifier : verifiers) {
+        int r = pthread_create(&verifier, NULL, verifier_func, (void *) client);
+        if (r) {
+            printf("Eroare la crearea unui thread de verificare\n");
+            exit(-1);
+        }
+    }
+
+    if (client->verify && client->print_stats) {
+        client->benchmark_md5();
+    }
+
+    double start = MPI_Wtime();
+    client->download_files();
+    double elapsed = MPI_Wtime() - start;
+    client->download_time = elapsed;
+
+    // All the segments are verified by now: stop the verifiers.
+    pthread_mutex_lock(&client->verify_mutex);
+    client->verify_stopping = true;
+    pthread_cond_broadcast(&client->verify_cond);
+    pthread_mutex_unlock(&client->verify_mutex);
+
+    for (auto &verifier : verifiers) {
+        int r = pthread_join(verifier, NULL);
+        if (r) {
+            printf("Eroare la asteptarea unui thread de verificare\n");
+            exit(-1);
+        }
+    }
+
+    client->leave_uploaders();
+    client->flush_notifications();
+
+    if (client->print_stats) {
+        cerr << "[client " << client->rank << "] endgame: " << client->stats.endgame_requests
+             << " duplicate requests for " << client->stats.endgame_positions << " segments, "
+             << client->stats.cancels_sent << " cancels sent, "
+             << client->stats.cancelled_requests << " requests cancelled in time, "
+             << client->stats.duplicate_segments << " duplicate segments received, "
+             << client->stats.timeouts << " requests timed out (" << client->stats.requeued_positions
+             << " segments asked again)\n";
+
+        // The peers that let requests time out, to tell a straggler apart.
+        if (client->stats.timeouts > 0) {
+            const char *separator = " ";
+            cerr << "[client " << client->rank << "] timed out requests by peer:";
+            for (int peer = 0; peer < client->numtasks; peer++) {
+                auto it = client->peer_stats.find(peer);
+                if (it != client->peer_stats.end() && it->second.timeouts > 0) {
+                    cerr << separator << peer << " -> " << it->second.timeouts;
+                    separator = ", ";
+                }
+            }
+            cerr << "\n";
+        }
+        cerr << "[client " << client->rank << "] pex: " << client->stats.pex_learned
+             << " swarm members learned from peers, " << client->stats.pex_sent << " PEX messages sent, "
+             << client->stats.who_has_sent << " WHO_HAS sent\n";
+
+        if (client->payload) {
+            cerr << "[client " << client->rank << "] payload: " << client->stats.payload_bytes
+                 << " bytes received in " << elapsed << " s ("
+                 << client->stats.payload_bytes / elapsed / 1e9 << " GB/s)\n";
         }
 
-        client->announce_tracker_whole_file_received(wanted_file);
+        if (client->verify) {
+            cerr << "[client " << client->rank << "] verify: " << client->hashed_segments
+                 << " segments hashed in " << client->hashing_time << " s ("
+                 << client->hashed_segments / max(client->hashing_time, 1e-9) << " hashes/s), "
+                 << client->stats.corrupt_segments << " corrupt segments asked again\n";
+        }
 
-        client->save_file(wanted_file);
+        if (client->choke) {
+            cerr << "[client " << client->rank << "] choke: " << client->stats.chokes_received
+                 << " chokes received, " << client->stats.choked_requests << " requests refused by "
+                 << "choking peers\n";
+        }
     }
 
     client->announce_tracker_all_files_received();
 
+    // Keep consuming notifications until the tracker stops everyone.
+    client->wait_for_stop();
+
     return NULL;
 }
 
 
-void Client::receive_file_details_from_tracker(const std::string &wanted_file, std::vector<int> &swarm,
-                                               std::vector<Segment> &segments) {
-    // Send "Hello" message to the tracker, initialising a FILE_DETAILS communication.
-    int msg = FILE_DETAILS_REQ;
-    MPI_Send(&msg, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+void Client::download_files() {
+    // Sessions are kept in a list, so the request slots can point to them.
+    list<FileSession> sessions;
+    auto next_file = this->wanted_files.begin();
 
-    // Send the name of the file to the tracker (including '\0').
-    MPI_Send(wanted_file.c_str(), wanted_file.size() + 1, MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+    while (true) {
+        // Start new sessions while there is room for them.
+        while ((int) sessions.size() < this->max_sessions && next_file != this->wanted_files.end()) {
+            sessions.emplace_back();
+            if (!start_session(sessions.back(), *next_file)) {
+                sessions.pop_back();
+            }
+            next_file++;
+        }
 
-    receive_file_swarm_from_tracker(swarm);
-    receive_file_segment_details_from_tracker(segments);
-}
+        if (sessions.empty()) {
+            break;
+        }
+
+        // Fill the request window, one request per session at a time, so no
+        // session can take all the slots.
+        bool issued = true;
+        while (issued && this->in_flight < (int) this->slots.size()) {
+            issued = false;
+
+            for (auto &session : sessions) {
+                if (this->in_flight < (int) this->slots.size() && issue_segment_request(session)) {
+                    issued = true;
+                }
+            }
+        }
+
+        if (this->in_flight == 0 && this->verifications == 0) {
+            // No known owner for any pending segment: wait for a HAVE from one of the peers.
+            wait_for_notification(MPI_ANY_SOURCE);
+        } else {
+            // Poll for replies, so the deadlines of the requests can be enforced.
+            int done_cnt = 0;
+            if (this->in_flight > 0) {
+                vector<int> done(this->slots.size());
+                vector<MPI_Status> statuses(this->slots.size());
+                MPI_Testsome(this->slots.size(), this->reply_requests.data(), &done_cnt, done.data(),
+                             statuses.data());
+
+                for (int k = 0; k < done_cnt; k++) {
+                    complete_segment_request(done[k], statuses[k]);
+                }
+            }
+
+            int verified = this->verify ? collect_verified_segments() : 0;
+            int timed_out = check_request_deadlines();
 
+            if (done_cnt == 0 && verified == 0 && timed_out == 0 && !has_incoming_message()) {
+                usleep(POLL_INTERVAL_US);
+            }
+        }
+
+        // Handle the HAVEs and bitfields that arrived meanwhile.
+        drain_notifications();
+
+        auto it = sessions.begin();
+        while (it != sessions.end()) {
+            // Wait for the replies to the endgame copies too, so every request
+            // gets its reply before the session goes away.
+            if (it->received == it->segments.size() && it->in_flight == 0) {
+                finish_session(*it);
+                it = sessions.erase(it);
+                continue;
+            }
 
-void Client::receive_file_swarm_from_tracker(std::vector<int> &swarm) {
-    // Receive the size of the swarm.
-    int swarm_size;
-    MPI_Recv(&swarm_size, 1, MPI_INT, TRACKER_RANK, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            // Refresh the swarm of a file when the tracker says it changed.
+            if (this->stale_swarms[it->file]) {
+                this->stale_swarms[it->file] = false;
+                update_swarm_from_tracker(*it);
+                request_bitfields(it->file, it->swarm, it->contacted);
+            }
+
+            if (this->pex) {
+                exchange_swarm_members(*it);
+            }
 
-    // Receive the swarm.
-    for (int i = 0; i < swarm_size; i++) {
-        int client_id;
-        MPI_Recv(&client_id, 1, MPI_INT, TRACKER_RANK, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+            if (this->replica_index) {
+                ask_segment_owners(*it);
+            }
 
-        swarm.push_back(client_id);
+            it++;
+        }
     }
 }
 
 
-void Client::receive_file_segment_details_from_tracker(std::vector<Segment> &segments) {
-    // Receive the number of segments.
-    int segment_cnt;
-    MPI_Recv(&segment_cnt, 1, MPI_INT, TRACKER_RANK, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/*
+ * Returns false if the file cannot be downloaded (no tracker knows it).
+ */
+bool Client::start_session(FileSession &session, const std::string &wanted_file) {
+    session.start_time = MPI_Wtime();
+    session.received = 0;
+    session.gossiped_version = -1;
+    session.in_flight = 0;
+
+    if (!receive_file_details_from_tracker(session, wanted_file)) {
+        return false;
+    }
+    int file = session.file;
+
+    // Allocate the data of the file, so the segments can be received in place.
+    session.data = NULL;
+    if (this->payload) {
+        session.data = map_file_data(file, session.segments.size(), false);
+        this->file_data[file].store(session.data, memory_order_release);
+    }
 
-    // Receive segment details.
-    for (int i = 0; i < segment_cnt; i++) {
-        // Receive segment hash (add '\0' manually).
-        char hash_buff[HASH_SIZE + 1];
-        MPI_Recv(hash_buff, HASH_SIZE, MPI_CHAR, TRACKER_RANK, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        hash_buff[HASH_SIZE] = '\0';
-        string hash(hash_buff);
+    // Publish an empty bitfield, so the upload thread can start answering for this file.
+    session.bitfield = new Bitfield(session.segments.size());
+    this->owned_segments[file].store(session.bitfield, memory_order_release);
+
+    // Learn which segments each swarm member owns, once per member.
+    this->downloading[file] = true;
+    this->availability[file] = Availability(session.segments.size());
+
+    // Every segment is pending, with no known owner yet; the availability
+    // table moves it to another bucket each time it learns of an owner.
+    session.pending = PendingSegments(session.segments.size());
+    session.position_of.assign(session.segments.size(), -1);
+    for (int i = 0; i < session.segments.size(); i++) {
+        session.pending.add(session.segments.indices[i], 0);
+        session.position_of[session.segments.indices[i]] = i;
+    }
+    this->availability[file].pending = &session.pending;
 
-        // Receive segment index.
-        int idx;
-        MPI_Recv(&idx, 1, MPI_INT, TRACKER_RANK, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    request_bitfields(file, session.swarm, session.contacted);
 
-        segments.emplace_back(hash, idx);
+    if (this->replica_index) {
+        ask_segment_owners(session);
     }
+
+    return true;
 }
 
 
-void Client::update_swarm_from_tracker(const std::string &wanted_file, std::vector<int> &swarm) {
-    swarm.clear();
+void Client::finish_session(FileSession &session) {
+    if (this->print_stats) {
+        cerr << "[client " << this->rank << "] " << this->file_names[session.file] << " downloaded in "
+             << MPI_Wtime() - session.start_time << " s\n";
+    }
+
+    // HAVEs for this file are no longer needed.
+    for (int peer : session.contacted) {
+        notify(Message(NOT_INTERESTED, session.file, 0, 0), peer, UPLOAD_TAG);
+    }
+    this->downloading[session.file] = false;
+    this->availability[session.file] = Availability();
+    this->stale_swarms[session.file] = false;
+    this->discovered[session.file].clear();
+    this->who_has_pending[session.file] = false;
+    this->who_has_time[session.file] = 0;
+    this->who_has_rounds[session.file] = 0;
 
-    // Send "Hello" message to the tracker, initialising an UPDATE_SWARM communication.
-    int msg = UPDATE_SWARM_REQ;
-    MPI_Send(&msg, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+    // FILE_DOWNLOAD_COMPLETE reports all the segments at once.
+    session.unreported.clear();
 
-    // Send the name of the file to the tracker (including '\0').
-    MPI_Send(wanted_file.c_str(), wanted_file.size() + 1, MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+    announce_tracker_whole_file_received(session.file);
 
-    receive_file_swarm_from_tracker(swarm);
+    save_file(session.file);
 }
 
 
-int Client::get_peer_with_min_load_for_segment(const std::string &file, int segment_idx,
-                                               std::vector<int> &swarm) {
-    int min_load = INT_MAX;
-    int peer_with_min_load = -1;
+bool Client::issue_segment_request(FileSession &session) {
+    const Availability &file_availability = this->availability[session.file];
 
-    for (int peer : swarm) {
-        // Do not consider self as a valid peer to ask for the segment.
-        if (peer == this->rank) {
-            continue;
+    if (session.pending.empty()) {
+        // Endgame: only the last few segments are left, all of them in flight.
+        // The received ones still waiting for the replies of their other
+        // copies are not counted.
+        int missing = session.segments.size() - session.received - (int) session.verifying.size()
+                      - (int) session.landing.size();
+        if (missing <= this->endgame_threshold) {
+            return issue_endgame_request(session);
         }
 
-        // Send "Hello" message to peer, initialising a HAS_SEGMENT communication.
-        int msg = HAS_SEGMENT_REQ;
-        MPI_Send(&msg, 1, MPI_INT, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+        return false;
+    }
 
-        // Send file name (including '\0').
-        MPI_Send(file.c_str(), file.size() + 1, MPI_CHAR, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+    // No segment can be asked while every known owner has a full window.
+    if (!has_free_owner(session.file)) {
+        return false;
+    }
 
-        // Send segment index.
-        MPI_Send(&segment_idx, 1, MPI_INT, peer, UPLOAD_TAG, MPI_COMM_WORLD);
+    int best_idx = -1;
+    int best_peer = -1;
 
-        // Receive response.
-        int response;
-        MPI_Recv(&response, 1, MPI_INT, peer, DOWNLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // Random first: the first few segments of a file are picked at random, so
+    // the peers of a flash crowd do not all start with the same ones.
+    bool random_first = session.received + session.in_flight < RANDOM_FIRST_SEGMENTS;
 
-        if (response == NACK) {
-            // Peer does not own this segment.
-            continue;
-        }
+    if (random_first) {
+        int offset = this->rng() % session.pending.size();
 
-        // If response is not NACK, then it represents the load of the peer.
-        if (response == 0) {
-            return peer;
+        for (int k = 0; k < session.pending.size() && best_peer == -1; k++) {
+            int segment_idx = session.pending.at((offset + k) % session.pending.size());
+
+            if (file_availability.counts[segment_idx] > 0) {
+                best_idx = segment_idx;
+                best_peer = choose_peer_for_position(session, session.position_of[segment_idx]);
+            }
         }
+    }
+
+    // Then rarest first: the buckets of the pending segments are scanned from
+    // the fewest known owners up. Segments whose owners are all busy are
+    // skipped, so different segments are requested from different peers at
+    // the same time.
+    for (int count = 1; !random_first && count <= session.pending.max_count() && best_peer == -1; count++) {
+        for (int segment_idx : session.pending.with_count(count)) {
+            best_peer = choose_peer_for_position(session, session.position_of[segment_idx]);
 
-        if (response < min_load) {
-            min_load = response;
-            peer_with_min_load = peer;
+            if (best_peer != -1) {
+                best_idx = segment_idx;
+                break;
+            }
         }
     }
 
-    return peer_with_min_load;
-}
+    if (best_peer == -1) {
+        return false;
+    }
 
+    // Coalesce the run of consecutive pending segments that follows, as long
+    // as the chosen peer owns them, into the same request.
+    vector<int> positions;
+    positions.push_back(session.position_of[best_idx]);
+    session.pending.remove(best_idx);
 
-void *upload_thread_func(void *arg) {
-    Client *client = (Client*) arg;
+    while (!random_first && (int) positions.size() < this->segment_batch) {
+        int segment_idx = session.segments.indices[positions.back()] + 1;
 
-    bool should_stop = false;
+        if (!session.pending.contains(segment_idx) || !file_availability.has(best_peer, segment_idx)) {
+            break;
+        }
 
-    while (true) {
-        MPI_Status status;
-        int msg;
+        int position = session.position_of[segment_idx];
+        if (session.in_flight_slots.count(position) || session.corrupt_from.count(position)) {
+            break;
+        }
 
-        // Receive "Hello" message.
-        MPI_Recv(&msg, 1, MPI_INT, MPI_ANY_SOURCE, UPLOAD_TAG, MPI_COMM_WORLD, &status);
+        positions.push_back(position);
+        session.pending.remove(segment_idx);
+    }
 
-        switch (msg) {
-            case HAS_SEGMENT_REQ:
-                client->handle_has_segment_req_from_peer(status.MPI_SOURCE);
-                break;
+    send_segment_request(session, positions, best_peer);
 
-            case GET_SEGMENT_REQ:
-                client->handle_get_segment_req_from_peer(status.MPI_SOURCE);
-                break;
+    return true;
+}
 
-            case STOP:
-                should_stop = true;
-                break;
+
+/*
+ * The owner to ask for a pending position (-1 if all of them are busy). A
+ * requeued segment is never asked twice from the same peer, nor from a peer
+ * that sent a corrupt copy of it. When all the known owners did, the segment
+ * waits for other owners, and the client fails once none can be learned.
+ */
+int Client::choose_peer_for_position(FileSession &session, int position) {
+    int segment_idx = session.segments.indices[position];
+    int count = this->availability[session.file].counts[segment_idx];
+
+    vector<int> asked;
+    auto slots_it = session.in_flight_slots.find(position);
+    if (slots_it != session.in_flight_slots.end()) {
+        for (int slot : slots_it->second) {
+            asked.push_back(this->slots[slot].peer);
         }
+    }
 
-        if (should_stop) {
-            break;
+    auto corrupt_it = session.corrupt_from.find(position);
+    if (corrupt_it != session.corrupt_from.end()) {
+        if ((int) corrupt_it->second.size() >= count) {
+            if (all_owners_known(session.file)) {
+                cerr << "[client " << this->rank << "] every owner of segment " << segment_idx << " of "
+                     << this->file_names[session.file] << " sent a corrupt copy.\n";
+                exit(-1);
+            }
+
+            return -1;
         }
+
+        asked.insert(asked.end(), corrupt_it->second.begin(), corrupt_it->second.end());
     }
 
-    return NULL;
+    return choose_peer_for_segment(session.file, segment_idx, asked);
 }
 
 
-void Client::handle_has_segment_req_from_peer(int peer_idx) {
-    // Receive file name (including '\0').
-    char buff[MAX_FILENAME + 1];
-    MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, peer_idx, UPLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    string file_name(buff);
+/*
+ * Whether no other owner of the segments of the file can be learned: every
+ * bitfield asked for has arrived or, with the replica index, the re-queries
+ * of the tracker have gone once around all the ranks. A client that joins
+ * later can only get a segment from the owners already known.
+ */
+bool Client::all_owners_known(int file) {
+    if (this->replica_index) {
+        return !this->who_has_pending[file]
+               && this->who_has_rounds[file] * WHO_HAS_MAX_OWNERS >= this->numtasks;
+    }
 
-    // Receive segment index.
-    int segment_idx;
-    MPI_Recv(&segment_idx, 1, MPI_INT, peer_idx, UPLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    return this->bitfields_pending == 0;
+}
 
-    // Lock if the file is a wanted file of the client
-    // (i.e. might be modified concurrently by the download thread).
-    bool should_lock = this->wanted_files.find(file_name) != this->wanted_files.end();
 
-    if (should_lock) {
-        pthread_mutex_lock(&this->owned_files_mutex);
+/*
+ * Whether a known owner of some segment of the file has room in its window.
+ */
+bool Client::has_free_owner(int file) {
+    for (const auto &[peer, segments] : this->availability[file].peers) {
+        if (this->peer_in_flight[peer] < this->peer_window && !this->peer_stats[peer].choked) {
+            return true;
+        }
     }
 
-    // Check if that segment is owned by the client.
-    for (const auto &segment : owned_files[file_name]) {
-        if (segment.index == segment_idx) {
-            // Send ACK message back to the peer, by sending the load of the client.
-            int response = this->load;
-            MPI_Send(&response, 1, MPI_INT, peer_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    return false;
+}
 
-            if (should_lock) {
-                pthread_mutex_unlock(&this->owned_files_mutex);
-            }
-            return;
+
+bool Client::issue_endgame_request(FileSession &session) {
+    // Ask one more owner for an in-flight segment, so a slow peer cannot
+    // delay the completion of the whole file.
+    for (const auto &[position, position_slots] : session.in_flight_slots) {
+        if ((int) position_slots.size() >= ENDGAME_COPIES) {
+            continue;
+        }
+
+        // A received copy only waits for the replies of the others.
+        if (has_arrived(session, position)) {
+            continue;
+        }
+
+        vector<int> asked;
+        for (int slot : position_slots) {
+            asked.push_back(this->slots[slot].peer);
+        }
+
+        auto corrupt_it = session.corrupt_from.find(position);
+        if (corrupt_it != session.corrupt_from.end()) {
+            asked.insert(asked.end(), corrupt_it->second.begin(), corrupt_it->second.end());
+        }
+
+        int peer = choose_peer_for_segment(session.file, session.segments.indices[position], asked);
+        if (peer == -1) {
+            continue;
         }
-    }
 
-    if (should_lock) {
-        pthread_mutex_unlock(&this->owned_files_mutex);
+        if (position_slots.size() == 1) {
+            this->stats.endgame_positions++;
+        }
+
+        send_segment_request(session, {position}, peer);
+        this->stats.endgame_requests++;
+
+        return true;
     }
 
-    // Send NACK message back to the peer.
-    int response = NACK;
-    MPI_Send(&response, 1, MPI_INT, peer_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    return false;
 }
 
 
-void Client::handle_get_segment_req_from_peer(int peer_idx) {
-    // Receive file name (including '\0').
-    char buff[MAX_FILENAME + 1];
-    MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, peer_idx, UPLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    string file_name(buff);
+void Client::send_segment_request(FileSession &session, const std::vector<int> &positions, int peer) {
+    int slot = this->free_slots.back();
+    this->free_slots.pop_back();
+
+    SegmentRequest &request = this->slots[slot];
+    request.session = &session;
+    request.peer = peer;
+    request.positions = positions;
+    request.start_time = MPI_Wtime();
+    request.deadline = request.start_time + request_timeout(peer);
+    request.timed_out = false;
+
+    // Post the receive of the reply before sending the request. The reply
+    // tag identifies the slot, so the reply lands directly in its buffer.
+    int reply_tag = REPLY_TAG_BASE + slot;
+    MPI_Irecv(request.reply_buff, MAX_REPLY_SIZE, MPI_BYTE, peer, reply_tag, MPI_COMM_WORLD,
+              &this->reply_requests[slot]);
+
+    // The segments are sent as (first index, count) ranges.
+    vector<int> indices;
+    for (int position : positions) {
+        indices.push_back(session.segments.indices[position]);
+    }
 
-    // Receive segment index.
-    int segment_idx;
-    MPI_Recv(&segment_idx, 1, MPI_INT, peer_idx, UPLOAD_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    vector<int> ranges;
+    index_ranges(indices, ranges);
+
+    // Payload mode: the bytes of the segments land directly at their place in
+    // the mapped file or, to be verified first, in a staging buffer of the
+    // request (in the order of the positions). A segment that is still asked
+    // from another peer (a timed out request, an endgame copy) is staged too,
+    // since the other receive may still write its bytes in the file.
+    request.in_place = this->payload && !this->verify;
+    for (int position : positions) {
+        auto slots_it = session.in_flight_slots.find(position);
+        if (slots_it != session.in_flight_slots.end() && !slots_it->second.empty()) {
+            request.in_place = false;
+        }
+    }
 
-    // Add load to the client.
-    this->load++;
+    request.staging.reset();
+    if (request.in_place) {
+        MPI_Datatype type = segments_datatype(ranges);
+        MPI_Irecv(session.data, 1, type, peer, DATA_TAG_BASE + slot, MPI_COMM_WORLD, &request.data_request);
+        MPI_Type_free(&type);
+    } else if (this->payload) {
+        request.staging = make_shared<vector<char>>(positions.size() * this->segment_size);
+        MPI_Irecv(request.staging->data(), request.staging->size(), MPI_BYTE, peer, DATA_TAG_BASE + slot,
+                  MPI_COMM_WORLD, &request.data_request);
+    }
 
-    // Send response to the peer (simulate the sending of the segment).
-    int response = ACK;
-    MPI_Send(&response, 1, MPI_INT, peer_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
-}
+    Message msg(GET_SEGMENTS, session.file, session.segments.indices[positions[0]], reply_tag);
+    msg.append_int(ranges.size() / 2);
+    msg.append(ranges.data(), ranges.size() * sizeof(int));
+    msg.isend(peer, UPLOAD_TAG, request.send_buff, &request.send_request);
 
+    session.contacted.insert(peer);
+    this->known_uploaders.insert(peer);
 
-void Client::announce_tracker_whole_file_received(const std::string &file) {
-    // Send "Hello" message to the tracker, initialising a FILE_DOWNLOAD_COMPLETE communication.
-    int msg = FILE_DOWNLOAD_COMPLETE;
-    MPI_Send(&msg, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+    this->peer_in_flight[peer]++;
+    this->in_flight++;
+    session.in_flight += positions.size();
 
-    // Send the name of the file to the tracker (including '\0').
-    MPI_Send(file.c_str(), file.size() + 1, MPI_CHAR, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+    for (int position : positions) {
+        session.in_flight_slots[position].push_back(slot);
+    }
 }
 
 
-void Client::save_file(const std::string &file) {
-    ofstream out_file("client" + to_string(this->rank) + "_" + file);
+void Client::complete_segment_request(int slot, MPI_Status &status) {
+    SegmentRequest &request = this->slots[slot];
+    FileSession &session = *request.session;
 
-    vector<Segment>::iterator it = this->owned_files[file].begin();
+    // The reply implies the request was received, so this returns at once.
+    MPI_Wait(&request.send_request, MPI_STATUS_IGNORE);
 
-    while (it != this->owned_files[file].end()) {
-        out_file << it->hash;
+    int size;
+    MPI_Get_count(&status, MPI_BYTE, &size);
 
-        it++;
-        if (it != this->owned_files[file].end()) {
-            out_file << "\n";
+    Message response;
+    response.deserialize(request.reply_buff, size);
+
+    // The bytes are sent before the ACK; a refused request has none.
+    if (request.data_request != MPI_REQUEST_NULL) {
+        if (response.header.type == ACK) {
+            MPI_Wait(&request.data_request, MPI_STATUS_IGNORE);
+            this->stats.payload_bytes += request.positions.size() * this->segment_size;
+        } else {
+            MPI_Cancel(&request.data_request);
+            MPI_Wait(&request.data_request, MPI_STATUS_IGNORE);
         }
     }
 
-    out_file.close();
+    // What the peer uploaded to this client, for the choke scheduler. A CHOKE
+    // reply only refuses the request: the choke state itself comes from the
+    // CHOKE and UNCHOKE notifications, which are ordered.
+    if (response.header.type == ACK) {
+        this->received_from[request.peer] += request.positions.size();
+    } else if (response.header.type == CHOKE) {
+        this->stats.choked_requests++;
+    }
+
+    // Track the latency of the peer (exponentially weighted moving average).
+    PeerStats &peer_stats = this->peer_stats[request.peer];
+    double latency = MPI_Wtime() - request.start_time;
+    peer_stats.latency = peer_stats.replies == 0 ? latency
+                         : (1 - LATENCY_WEIGHT) * peer_stats.latency + LATENCY_WEIGHT * latency;
+    peer_stats.replies++;
+
+    // Cache the load of the peer, with the time it was learned.
+    peer_stats.load = response.header.value;
+    peer_stats.load_time = MPI_Wtime();
+
+    this->peer_in_flight[request.peer]--;
+    this->in_flight--;
+    this->free_slots.push_back(slot);
+
+    // A single reply serves (or refuses) the whole batch.
+    for (int position : request.positions) {
+        session.in_flight--;
+        complete_position(session, slot, position, response.header.type == ACK);
+    }
 }
 
 
-void Client::announce_tracker_all_files_received() {
-    // Send "Hello" message to the tracker, initialising an ALL_FILES_RECEIVED communication.
-    int msg = ALL_FILES_RECEIVED;
-    MPI_Send(&msg, 1, MPI_INT, TRACKER_RANK, TRACKER_TAG, MPI_COMM_WORLD);
+void Client::complete_position(FileSession &session, int slot, int position, bool served) {
+    int segment_idx = session.segments.indices[position];
+
+    // Forget this copy of the request.
+    vector<int> &position_slots = session.in_flight_slots[position];
+    position_slots.erase(find(position_slots.begin(), position_slots.end(), slot));
+
+    auto landing_it = session.landing.find(position);
+    if (landing_it != session.landing.end() && this->slots[slot].in_place) {
+        // The receive in place has ended, so the bytes of the copy that arrived
+        // first can now be written (unless this one wrote the same ones).
+        if (!served) {
+            const StagedSegment &segment = landing_it->second;
+            memcpy(session.data + segment_idx * this->segment_size, segment.staging->data() + segment.offset,
+                   this->segment_size);
+            this->stats.cancelled_requests++;
+        } else {
+            this->stats.duplicate_segments++;
+        }
+
+        session.landing.erase(landing_it);
+        receive_segment(session, position);
+    } else if (has_arrived(session, position)) {
+        // Another copy of an endgame request arrived first.
+        if (served) {
+            this->stats.duplicate_segments++;
+        } else {
+            this->stats.cancelled_requests++;
+        }
+    } else if (!served) {
+        // Not served: ask again, possibly someone else.
+        if (position_slots.empty()) {
+            requeue_position(session, position);
+        }
+    } else {
+        if (this->verify) {
+            verify_segment(session, slot, position);
+        } else if (this->payload && !this->slots[slot].in_place) {
+            land_segment(session, position, staged_segment(slot, position));
+        } else {
+            receive_segment(session, position);
+        }
+
+        // The other copies are not needed anymore. A batch is left alone, since
+        // cancelling it would refuse its other segments too.
+        for (int other : position_slots) {
+            if (this->slots[other].positions.size() > 1) {
+                continue;
+            }
+
+            Message cancel(CANCEL, session.file, segment_idx, REPLY_TAG_BASE + other);
+            notify(cancel, this->slots[other].peer, UPLOAD_TAG);
+            this->stats.cancels_sent++;
+        }
+    }
+
+    if (position_slots.empty()) {
+        session.in_flight_slots.erase(position);
+    }
+}
+
+
+void Client::receive_segment(FileSession &session, int position) {
+    int segment_idx = session.segments.indices[position];
+
+    // Add the "newly received" segment to the owned list, make it
+    // visible to the upload thread and tell the interested peers.
+    this->owned_files[session.file].add(segment_idx, session.segments.digests[position]);
+    session.bitfield->set(segment_idx);
+    announce_have(session.file, segment_idx);
+
+    if (this->replica_index) {
+        report_segment(session, segment_idx);
+    }
+
+    session.received++;
+    this->stats.received_segments++;
+}
+
+
+/*
+ * Whether a copy of the segment at the position has arrived already, even if
+ * it is not received yet (still being verified or waiting to land).
+ */
+bool Client::has_arrived(const FileSession &session, int position) {
+    return session.bitfield->test(session.segments.indices[position]) || session.verifying.count(position)
+           || session.landing.count(position);
+}
+
+
+// Where a segment of a request is in its staging buffer.
+StagedSegment Client::staged_segment(int slot, int position) {
+    const SegmentRequest &request = this->slots[slot];
+    size_t k = find(request.positions.begin(), request.positions.end(), position) - request.positions.begin();
+
+    return {request.staging, k * this->segment_size};
+}
+
+
+/*
+ * Copies a staged segment to the mapped file and receives it, unless another
+ * copy of its request still receives in place there: the segment then waits
+ * for that receive to end, and is neither written nor owned meanwhile.
+ */
+void Client::land_segment(FileSession &session, int position, const StagedSegment &segment) {
+    for (int other : session.in_flight_slots[position]) {
+        if (this->slots[other].in_place) {
+            session.landing[position] = segment;
+            return;
+        }
+    }
+
+    int segment_idx = session.segments.indices[position];
+    memcpy(session.data + segment_idx * this->segment_size, segment.staging->data() + segment.offset,
+           this->segment_size);
+    receive_segment(session, position);
+}
+
+
+/*
+ * Hands a received segment, still in the staging buffer of its request, to
+ * the verifiers. It is only received once its hash matches.
+ */
+void Client::verify_segment(FileSession &session, int slot, int position) {
+    StagedSegment segment = staged_segment(slot, position);
+
+    VerifyJob job;
+    job.session = &session;
+    job.position = position;
+    job.peer = this->slots[slot].peer;
+    job.staging = segment.staging;
+    job.offset = segment.offset;
+    job.valid = false;
+
+    session.verifying.insert(position);
+    this->verifications++;
+
+    pthread_mutex_lock(&this->verify_mutex);
+    this->verify_jobs.push_back(move(job));
+    pthread_cond_signal(&this->verify_cond);
+    pthread_mutex_unlock(&this->verify_mutex);
+}
+
+
+/*
+ * Called by a verifier: hashes the segments of the jobs side by side, in the
+ * lanes of the MD5 kernel, and compares them with the segment tables.
+ */
+void Client::verify_jobs_batch(std::vector<VerifyJob> &jobs) {
+    vector<const uint8_t *> data(jobs.size());
+    vector<Digest> digests(jobs.size());
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        data[i] = (const uint8_t *) jobs[i].staging->data() + jobs[i].offset;
+    }
+
+    md5_multi(data.data(), this->segment_size, digests.data(), jobs.size());
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const Digest &expected = jobs[i].session->segments.digests[jobs[i].position];
+        jobs[i].valid = memcmp(digests[i].bytes, expected.bytes, DIGEST_SIZE) == 0;
+    }
+}
+
+
+/*
+ * Receives the segments verified meanwhile. A corrupt segment is asked again,
+ * from another owner. Returns the number of collected segments.
+ */
+int Client::collect_verified_segments() {
+    deque<VerifyJob> jobs;
+
+    pthread_mutex_lock(&this->verify_mutex);
+    jobs.swap(this->verified_jobs);
+    pthread_mutex_unlock(&this->verify_mutex);
+
+    for (VerifyJob &job : jobs) {
+        FileSession &session = *job.session;
+        int segment_idx = session.segments.indices[job.position];
+
+        session.verifying.erase(job.position);
+        this->verifications--;
+
+        if (job.valid) {
+            memcpy(session.data + segment_idx * this->segment_size, job.staging->data() + job.offset,
+                   this->segment_size);
+            receive_segment(session, job.position);
+            continue;
+        }
+
+        this->stats.corrupt_segments++;
+        session.corrupt_from[job.position].push_back(job.peer);
+
+        // Ask again, unless another copy of the request is still on time.
+        bool live_copy = false;
+        for (int other : session.in_flight_slots[job.position]) {
+            if (!this->slots[other].timed_out) {
+                live_copy = true;
+            }
+        }
+
+        if (session.in_flight_slots[job.position].empty()) {
+            session.in_flight_slots.erase(job.position);
+        }
+
+        if (!live_copy) {
+            requeue_position(session, job.position);
+        }
+    }
+
+    return jobs.size();
+}
+
+
+/*
+ * Micro-benchmark of the MD5 kernels, on synthetic segments: one buffer at a
+ * time (scalar) against the lanes of the kernel picked for this CPU.
+ */
+void Client::benchmark_md5() {
+    int cnt = 4 * md5_lanes();
+    vector<char> buffer(cnt * this->segment_size, (char) this->rank);
+    vector<const uint8_t *> data(cnt);
+    vector<Digest> digests(cnt);
+
+    for (int i = 0; i < cnt; i++) {
+        data[i] = (const uint8_t *) buffer.data() + i * this->segment_size;
+    }
+
+    double start = MPI_Wtime();
+    for (int i = 0; i < cnt; i++) {
+        md5(data[i], this->segment_size, digests[i]);
+    }
+    double scalar_time = MPI_Wtime() - start;
+
+    start = MPI_Wtime();
+    md5_multi(data.data(), this->segment_size, digests.data(), cnt);
+    double multi_time = MPI_Wtime() - start;
+
+    cerr << "[client " << this->rank << "] md5: scalar " << cnt / scalar_time << " hashes/s, "
+         << md5_kernel_name() << " (" << md5_lanes() << " lanes) " << cnt / multi_time
+         << " hashes/s\n";
+}
+
+
+/*
+ * Deadline of a request to the given peer: a multiple of its average latency,
+ * but never less than REQUEST_TIMEOUT (the default for unknown peers).
+ */
+double Client::request_timeout(int peer) {
+    const PeerStats &peer_stats = this->peer_stats[peer];
+
+    if (peer_stats.replies == 0) {
+        return REQUEST_TIMEOUT;
+    }
+
+    return max(REQUEST_TIMEOUT, TIMEOUT_FACTOR * peer_stats.latency);
+}
+
+
+int Client::check_request_deadlines() {
+    double now = MPI_Wtime();
+    int timed_out = 0;
+
+    for (int slot = 0; slot < (int) this->slots.size(); slot++) {
+        SegmentRequest &request = this->slots[slot];
+
+        if (this->reply_requests[slot] == MPI_REQUEST_NULL || request.timed_out || now < request.deadline) {
+            continue;
+        }
+
+        // The request keeps its slot until its reply arrives, but the segment
+        // is asked from another owner right away.
+        request.timed_out = true;
+        timed_out++;
+
+        this->stats.timeouts++;
+        this->peer_stats[request.peer].timeouts++;
+
+        // Treat the elapsed time as a latency sample, so slow peers get longer deadlines.
+        PeerStats &peer_stats = this->peer_stats[request.peer];
+        peer_stats.latency = max(peer_stats.latency, now - request.start_time);
+
+        FileSession &session = *request.session;
+
+        Message cancel(CANCEL, session.file, session.segments.indices[request.positions[0]],
+                       REPLY_TAG_BASE + slot);
+        notify(cancel, request.peer, UPLOAD_TAG);
+        this->stats.cancels_sent++;
+
+        // Reassign each segment, unless another copy of its request is still on time.
+        for (int position : request.positions) {
+            bool live_copy = false;
+            for (int other : session.in_flight_slots[position]) {
+                if (!this->slots[other].timed_out) {
+                    live_copy = true;
+                }
+            }
+
+            if (!live_copy && !has_arrived(session, position)) {
+                requeue_position(session, position);
+                this->stats.requeued_positions++;
+            }
+        }
+    }
+
+    return timed_out;
+}
+
+
+void Client::requeue_position(FileSession &session, int position) {
+    int segment_idx = session.segments.indices[position];
+    session.pending.add(segment_idx, this->availability[session.file].counts[segment_idx]);
+}
+
+
+bool Client::has_incoming_message() {
+    int found;
+    MPI_Iprobe(MPI_ANY_SOURCE, DOWNLOAD_TAG, MPI_COMM_WORLD, &found, MPI_STATUS_IGNORE);
+
+    return found;
+}
+
+
+/*
+ * The only request that names a file by its name: the reply carries its ID.
+ * Returns false if the tracker does not know the file.
+ */
+bool Client::receive_file_details_from_tracker(FileSession &session, const std::string &file_name) {
+    double start = MPI_Wtime();
+
+    // Ask the tracker for the details of the file.
+    // With peer exchange or the replica index, the tracker does not need to
+    // notify this client of the changes of the swarm.
+    Message request(FILE_DETAILS_REQ, file_name, 0, this->pex || this->replica_index);
+    int tracker = tracker_of(file_name, this->trackers);
+    send_to_tracker(request, tracker);
+
+    // The ID, the swarm (with its version) and the segment details arrive in a single reply.
+    int source = tracker;
+    Message reply = wait_for_reply(source);
+
+    if (reply.header.type == NACK) {
+        cerr << "[client " << this->rank << "] unknown file " << file_name << ".\n";
+        return false;
+    }
+
+    session.file = reply.header.file;
+    this->file_names[session.file] = file_name;
+
+    session.swarm_version = reply.header.value;
+    unpack_file_swarm(reply, session.swarm);
+    set_swarm_members(session);
+    unpack_file_segment_details(reply, session.segments);
+
+    if (this->print_stats) {
+        cerr << "[client " << this->rank << "] FILE_DETAILS " << file_name << ": "
+             << session.segments.size() << " segments in " << (MPI_Wtime() - start) * 1e6 << " us\n";
+    }
+
+    return true;
+}
+
+
+void Client::unpack_file_swarm(Message &reply, std::vector<int> &swarm) {
+    reply.read_int_vector(swarm);
+}
+
+
+void Client::unpack_file_segment_details(Message &reply, SegmentTable &segments) {
+    reply.read_segment_table(segments);
+}
+
+
+void Client::update_swarm_from_tracker(FileSession &session) {
+    // Ask the tracker for the changes since the last known version of the swarm.
+    Message request(UPDATE_SWARM_REQ, session.file, 0, session.swarm_version);
+    int tracker = tracker_of(session.file, this->trackers);
+    send_to_tracker(request, tracker);
+
+    int source = tracker;
+    Message reply = wait_for_reply(source);
+
+    session.swarm_version = reply.header.value;
+
+    if (reply.header.type == SWARM_FULL) {
+        unpack_file_swarm(reply, session.swarm);
+        set_swarm_members(session);
+    } else if (reply.header.type == SWARM_DELTA) {
+        // Joins and promotions: only the new members matter here.
+        int changes_cnt = reply.read_int();
+
+        for (int i = 0; i < changes_cnt; i++) {
+            int member = reply.read_int();
+            reply.read_int();
+
+            add_swarm_member(session, member);
+        }
+    }
+}
+
+
+/*
+ * Marks the members of the swarm of the session, after it was replaced.
+ */
+void Client::set_swarm_members(FileSession &session) {
+    session.in_swarm.assign(this->numtasks, false);
+
+    for (int member : session.swarm) {
+        session.in_swarm[member] = true;
+    }
+}
+
+
+/*
+ * Merges into the swarm of the session the members learned from the other
+ * clients (peer exchange), and the peers that asked this client for its
+ * bitfield. The latter are gossiped to the contacted members, in a single
+ * PEX_MEMBERS message each; members learned from others are not forwarded.
+ * The subscribers are only looked at when they changed since the last pass.
+ */
+void Client::exchange_swarm_members(FileSession &session) {
+    vector<int> gossip;
+
+    int version = this->subscribers_versions[session.file].load(memory_order_acquire);
+    if (version != session.gossiped_version) {
+        session.gossiped_version = version;
+
+        for (int member : pex_members(session.file, this->rank)) {
+            if (add_swarm_member(session, member)) {
+                gossip.push_back(member);
+                this->stats.pex_learned++;
+            }
+        }
+    }
+
+    bool learned = !gossip.empty();
+
+    unordered_set<int> &discovered_members = this->discovered[session.file];
+    for (int member : discovered_members) {
+        if (add_swarm_member(session, member)) {
+            learned = true;
+            this->stats.pex_learned++;
+        }
+    }
+    discovered_members.clear();
+
+    if (!learned) {
+        return;
+    }
+
+    if (!gossip.empty()) {
+        Message msg(PEX_MEMBERS, session.file, 0, 0);
+        msg.append_int_vector(gossip);
+
+        for (int peer : session.contacted) {
+            if (find(gossip.begin(), gossip.end(), peer) == gossip.end()) {
+                notify(msg, peer, DOWNLOAD_TAG);
+                this->stats.pex_sent++;
+            }
+        }
+    }
+
+    request_bitfields(session.file, session.swarm, session.contacted);
+}
+
+
+/*
+ * Adds a member to the swarm of the session. Returns false if it already was
+ * one (or is this client).
+ */
+bool Client::add_swarm_member(FileSession &session, int member) {
+    if (member == this->rank || session.in_swarm[member]) {
+        return false;
+    }
+
+    session.swarm.push_back(member);
+    session.in_swarm[member] = true;
+    return true;
+}
+
+
+/*
+ * The peers subscribed to the HAVEs of a file (i.e. its other downloaders),
+ * except the given one. Called from both threads.
+ */
+vector<int> Client::pex_members(int file, int except) {
+    vector<int> members;
+
+    pthread_mutex_lock(&this->subscribers_mutex);
+    for (int peer : this->subscribers[file]) {
+        if (peer != except && (int) members.size() < PEX_MAX_MEMBERS) {
+            members.push_back(peer);
+        }
+    }
+    pthread_mutex_unlock(&this->subscribers_mutex);
+
+    return members;
+}
+
+
+void Client::report_segment(FileSession &session, int segment_idx) {
+    session.unreported.push_back(segment_idx);
+
+    if ((int) session.unreported.size() >= REPORT_BATCH) {
+        send_segments_report(session);
+    }
+}
+
+
+/*
+ * Reports the received segments to the tracker as (first index, count) ranges.
+ */
+void Client::send_segments_report(FileSession &session) {
+    vector<int> &indices = session.unreported;
+    sort(indices.begin(), indices.end());
+
+    vector<int> ranges;
+    index_ranges(indices, ranges);
+
+    Message report(SEGMENTS_REPORT, session.file, 0, 0);
+    report.append_int(ranges.size() / 2);
+    report.append(ranges.data(), ranges.size() * sizeof(int));
+    send_to_tracker(report, tracker_of(session.file, this->trackers));
+
+    indices.clear();
+}
+
+
+/*
+ * Asks the tracker for the owners of the pending segments with no known owner,
+ * WHO_HAS_BATCH at a time. The reply is merged into the availability table.
+ *
+ * The segments that already have owners are asked again every
+ * WHO_HAS_INTERVAL seconds, the rarest first, so the clients that got them
+ * meanwhile are learned too. Each of these queries starts the scan of the
+ * tracker further, so it does not return the same owners again.
+ */
+void Client::ask_segment_owners(FileSession &session) {
+    int file = session.file;
+
+    if (this->who_has_pending[file]) {
+        return;
+    }
+
+    vector<int> indices;
+    for (int segment_idx : session.pending.with_count(0)) {
+        indices.push_back(segment_idx);
+
+        if ((int) indices.size() == WHO_HAS_BATCH) {
+            break;
+        }
+    }
+
+    int offset = 0;
+    double now = MPI_Wtime();
+
+    if (indices.empty() && now - this->who_has_time[file] >= WHO_HAS_INTERVAL) {
+        for (int count = 1; count <= session.pending.max_count() && (int) indices.size() < WHO_HAS_BATCH; count++) {
+            for (int segment_idx : session.pending.with_count(count)) {
+                indices.push_back(segment_idx);
+
+                if ((int) indices.size() == WHO_HAS_BATCH) {
+                    break;
+                }
+            }
+        }
+
+        this->who_has_time[file] = now;
+        this->who_has_rounds[file]++;
+        offset = this->who_has_rounds[file] * WHO_HAS_MAX_OWNERS;
+    }
+
+    if (indices.empty()) {
+        return;
+    }
+
+    Message request(WHO_HAS, file, 0, offset);
+    request.append_int_vector(indices);
+    send_to_tracker(request, tracker_of(file, this->trackers));
+
+    this->who_has_pending[file] = true;
+    this->stats.who_has_sent++;
+}
+
+
+void Client::request_bitfields(int file, const std::vector<int> &swarm, std::unordered_set<int> &contacted) {
+    // With the replica index, the swarm is never probed.
+    if (this->replica_index) {
+        return;
+    }
+
+    // The replies are not waited for here: they are merged into the
+    // availability table whenever they arrive, like the HAVEs.
+    for (int peer : swarm) {
+        // Do not consider self as a valid peer to ask for segments.
+        if (peer == this->rank || contacted.count(peer)) {
+            continue;
+        }
+
+        notify(Message(BITFIELD_REQ, file, 0, 0), peer, UPLOAD_TAG);
+        this->bitfields_pending++;
+
+        contacted.insert(peer);
+        this->known_uploaders.insert(peer);
+    }
+}
+
+
+int Client::choose_peer_for_segment(int file, int segment_idx,
+                                    const std::vector<int> &excluded) {
+    const Availability &segment_owners = this->availability[file];
+
+    // The peers known to own the segment and with room in their window.
+    vector<int> candidates;
+    for (const auto &[peer, segments] : segment_owners.peers) {
+        if (!segment_owners.has(peer, segment_idx) || this->peer_in_flight[peer] >= this->peer_window
+            || this->peer_stats[peer].choked) {
+            continue;
+        }
+
+        if (find(excluded.begin(), excluded.end(), peer) != excluded.end()) {
+            continue;
+        }
+
+        candidates.push_back(peer);
+    }
+
+    if (candidates.empty()) {
+        return -1;
+    }
+
+    if (candidates.size() == 1) {
+        return candidates[0];
+    }
+
+    // Power of two choices: the less loaded of two random candidates.
+    int first = this->rng() % candidates.size();
+    int second = this->rng() % (candidates.size() - 1);
+    if (second >= first) {
+        second++;
+    }
+
+    int first_peer = candidates[first];
+    int second_peer = candidates[second];
+
+    return estimated_load(first_peer) <= estimated_load(second_peer) ? first_peer : second_peer;
+}
+
+
+/*
+ * The load of a peer, as last piggybacked on one of its replies (if recent
+ * enough), plus the requests sent to it since then.
+ */
+int Client::estimated_load(int peer) {
+    const PeerStats &peer_stats = this->peer_stats[peer];
+
+    int load = 0;
+    if (peer_stats.load_time > 0 && MPI_Wtime() - peer_stats.load_time <= LOAD_MAX_AGE) {
+        load = peer_stats.load;
+    }
+
+    return load + this->peer_in_flight[peer];
+}
+
+
+Message Client::wait_for_reply(int &source) {
+    while (true) {
+        MPI_Status status;
+        Message msg;
+        msg.recv(source, DOWNLOAD_TAG, &status);
+
+        if (!handle_notification(msg, status.MPI_SOURCE)) {
+            source = status.MPI_SOURCE;
+            return msg;
+        }
+
+        progress_notifications();
+    }
+}
+
+
+void Client::wait_for_notification(int source) {
+    while (true) {
+        MPI_Status status;
+        Message msg;
+        msg.recv(source, DOWNLOAD_TAG, &status);
+
+        progress_notifications();
+
+        if (handle_notification(msg, status.MPI_SOURCE)) {
+            return;
+        }
+
+        cerr << "Unexpected reply from " << status.MPI_SOURCE << ".\n";
+    }
+}
+
+
+bool Client::handle_notification(const Message &msg, int source) {
+    int file = msg.header.file;
+
+    switch (msg.header.type) {
+        case HAVE:
+            // Files that are not being downloaded anymore are ignored.
+            if (this->downloading[file]) {
+                this->availability[file].set(source, msg.header.segment_idx);
+            }
+            return true;
+
+        case BITFIELD:
+            this->bitfields_pending--;
+
+            if (this->downloading[file]) {
+                // The bitfield, then the downloaders known by the peer.
+                Message reply = msg;
+                vector<uint64_t> words((reply.header.value + 63) / 64);
+                reply.read(words.data(), words.size() * sizeof(uint64_t));
+                this->availability[file].merge(source, words);
+
+                vector<int> members;
+                reply.read_int_vector(members);
+                this->discovered[file].insert(members.begin(), members.end());
+            }
+            return true;
+
+        case WHO_HAS_REPLY:
+            this->who_has_pending[file] = false;
+
+            if (this->downloading[file]) {
+                Message reply = msg;
+                int segments_cnt = reply.read_int();
+
+                for (int i = 0; i < segments_cnt; i++) {
+                    int segment_idx = reply.read_int();
+
+                    vector<int> owners;
+                    reply.read_int_vector(owners);
+
+                    for (int owner : owners) {
+                        this->availability[file].set(owner, segment_idx);
+                    }
+                }
+            }
+            return true;
+
+        case PEX_MEMBERS:
+            if (this->downloading[file]) {
+                Message gossip = msg;
+                vector<int> members;
+                gossip.read_int_vector(members);
+                this->discovered[file].insert(members.begin(), members.end());
+            }
+            return true;
+
+        case SWARM_CHANGED:
+            if (this->downloading[file]) {
+                this->stale_swarms[file] = true;
+            }
+            return true;
+
+        case CHOKE:
+            // The last one from a peer answers the leaving of this client.
+            if (msg.header.value == 1) {
+                this->farewells_pending--;
+            } else {
+                this->peer_stats[source].choked = true;
+                this->stats.chokes_received++;
+            }
+            return true;
+
+        case UNCHOKE:
+            this->peer_stats[source].choked = false;
+            return true;
+
+        case STOP:
+            // One from each tracker.
+            this->stops_received++;
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+
+void Client::announce_have(int file, int segment_idx) {
+    pthread_mutex_lock(&this->subscribers_mutex);
+    vector<int> peers = this->subscribers[file];
+    pthread_mutex_unlock(&this->subscribers_mutex);
+
+    for (int peer : peers) {
+        notify(Message(HAVE, file, segment_idx, 0), peer, DOWNLOAD_TAG);
+    }
+}
+
+
+void Client::notify(const Message &msg, int dest, int tag) {
+    this->notification_buffers.emplace_back();
+    this->notification_requests.emplace_back();
+
+    msg.issend(dest, tag, this->notification_buffers.back(), &this->notification_requests.back());
+}
+
+
+void Client::progress_notifications() {
+    progress_sends(this->notification_requests, this->notification_buffers);
+}
+
+
+void Client::drain_notifications() {
+    MPI_Status status;
+    Message msg;
+
+    while (msg.try_recv(MPI_ANY_SOURCE, DOWNLOAD_TAG, &status)) {
+        if (!handle_notification(msg, status.MPI_SOURCE)) {
+            cerr << "Unexpected reply from " << status.MPI_SOURCE << ".\n";
+        }
+    }
+
+    progress_notifications();
+}
+
+
+void Client::flush_notifications() {
+    progress_notifications();
+
+    // The destinations may be waiting for our own notifications to complete,
+    // so keep receiving while waiting. The BITFIELDs asked for are waited for
+    // too, since their senders may answer late.
+    while (!this->notification_requests.empty() || this->bitfields_pending > 0) {
+        MPI_Status status;
+        Message msg;
+
+        if (msg.try_recv(MPI_ANY_SOURCE, DOWNLOAD_TAG, &status)) {
+            handle_notification(msg, status.MPI_SOURCE);
+        } else {
+            usleep(POLL_INTERVAL_US);
+        }
+
+        progress_notifications();
+    }
+}
+
+
+/*
+ * Tells the upload thread of every peer that knows this client that it will
+ * not ask for anything anymore, and waits for their last CHOKE, so no CHOKE
+ * or UNCHOKE of theirs can arrive after this thread stops.
+ */
+void Client::leave_uploaders() {
+    if (!this->choke) {
+        return;
+    }
+
+    for (int peer : this->known_uploaders) {
+        notify(Message(NOT_INTERESTED, -1, 0, 0), peer, UPLOAD_TAG);
+    }
+    this->farewells_pending = this->known_uploaders.size();
+
+    while (this->farewells_pending > 0) {
+        wait_for_notification(MPI_ANY_SOURCE);
+    }
+}
+
+
+void Client::wait_for_stop() {
+    while (this->stops_received < this->trackers) {
+        wait_for_notification(MPI_ANY_SOURCE);
+    }
+}
+
+
+void *upload_thread_func(void *arg) {
+    Client *client = (Client*) arg;
+
+    // This thread only dispatches requests; a pool of workers serves them.
+    vector<pthread_t> workers(client->upload_workers);
+    for (auto &worker : workers) {
+        int r = pthread_create(&worker, NULL, upload_worker_func, (void *) client);
+        if (r) {
+            printf("Eroare la crearea unui thread de upload\n");
+            exit(-1);
+        }
+    }
+
+    double start = MPI_Wtime();
+
+    // The choke scheduler and the rate limit have work to do on their own
+    // (rechokes, throttled requests), so the requests are then polled for.
+    bool scheduled = client->choke || client->upload_rate > 0;
+
+    while (true) {
+        MPI_Status status;
+        UploadJob job;
+
+        // Receive the next request.
+        if (scheduled) {
+            client->schedule_uploads();
+
+            if (!job.request.try_recv(MPI_ANY_SOURCE, UPLOAD_TAG, &status)) {
+                usleep(POLL_INTERVAL_US);
+                continue;
+            }
+        } else {
+            job.request.recv(MPI_ANY_SOURCE, UPLOAD_TAG, &status);
+        }
+        job.peer = status.MPI_SOURCE;
+
+        if (job.request.header.type == STOP) {
+            break;
+        }
+
+        client->dispatch_upload_job(job);
+    }
+
+    // Let the workers finish the queued jobs, then stop them.
+    pthread_mutex_lock(&client->upload_jobs_mutex);
+    client->upload_stopping = true;
+    pthread_cond_broadcast(&client->upload_jobs_cond);
+    pthread_mutex_unlock(&client->upload_jobs_mutex);
+
+    for (auto &worker : workers) {
+        int r = pthread_join(worker, NULL);
+        if (r) {
+            printf("Eroare la asteptarea unui thread de upload\n");
+            exit(-1);
+        }
+    }
+
+    if (client->print_stats) {
+        double elapsed = MPI_Wtime() - start;
+        cerr << "[client " << client->rank << "] served " << client->load.load() << " segments with "
+             << client->upload_workers << " upload workers in " << elapsed << " s ("
+             << client->load.load() / elapsed << " segments/s)\n";
+
+        // How evenly the segments were shared among the peers that got some.
+        vector<double> served;
+        for (auto &segments : client->served_to) {
+            if (segments.load() > 0) {
+                served.push_back(segments.load());
+            }
+        }
+        cerr << "[client " << client->rank << "] served " << served.size()
+             << " peers, Jain's fairness index " << jain_index(served) << "\n";
+
+        if (client->choke || client->upload_rate > 0) {
+            const ChokeStats &choke_stats = client->choke_stats;
+            cerr << "[client " << client->rank << "] upload scheduler: " << choke_stats.rechokes
+                 << " rechokes, " << choke_stats.chokes_sent << " chokes and " << choke_stats.unchokes_sent
+                 << " unchokes sent, " << choke_stats.optimistic_unchokes << " optimistic unchokes, "
+                 << choke_stats.refused_requests << " requests refused, " << choke_stats.throttled_requests
+                 << " requests throttled\n";
+        }
+    }
+
+    return NULL;
+}
+
+
+void *upload_worker_func(void *arg) {
+    Client *client = (Client*) arg;
+
+    while (true) {
+        pthread_mutex_lock(&client->upload_jobs_mutex);
+        while (client->upload_jobs.empty() && !client->upload_stopping) {
+            pthread_cond_wait(&client->upload_jobs_cond, &client->upload_jobs_mutex);
+        }
+
+        if (client->upload_jobs.empty()) {
+            pthread_mutex_unlock(&client->upload_jobs_mutex);
+            break;
+        }
+
+        UploadJob job = move(client->upload_jobs.front());
+        client->upload_jobs.pop_front();
+        pthread_mutex_unlock(&client->upload_jobs_mutex);
+
+        client->serve_upload_job(job);
+    }
+
+    return NULL;
+}
+
+
+void *verifier_func(void *arg) {
+    Client *client = (Client*) arg;
+    int lanes = md5_lanes();
+
+    while (true) {
+        pthread_mutex_lock(&client->verify_mutex);
+        while (client->verify_jobs.empty() && !client->verify_stopping) {
+            pthread_cond_wait(&client->verify_cond, &client->verify_mutex);
+        }
+
+        if (client->verify_jobs.empty()) {
+            pthread_mutex_unlock(&client->verify_mutex);
+            break;
+        }
+
+        // Take as many segments as the kernel hashes at once.
+        vector<VerifyJob> jobs;
+        while (!client->verify_jobs.empty() && (int) jobs.size() < lanes) {
+            jobs.push_back(move(client->verify_jobs.front()));
+            client->verify_jobs.pop_front();
+        }
+        pthread_mutex_unlock(&client->verify_mutex);
+
+        double start = MPI_Wtime();
+        client->verify_jobs_batch(jobs);
+        double elapsed = MPI_Wtime() - start;
+
+        pthread_mutex_lock(&client->verify_mutex);
+        for (VerifyJob &job : jobs) {
+            client->verified_jobs.push_back(move(job));
+        }
+        client->hashed_segments += jobs.size();
+        client->hashing_time += elapsed;
+        pthread_mutex_unlock(&client->verify_mutex);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Number of segments asked by a GET_SEGMENTS, read from a copy of it, so
+ * the worker serving it can still read it.
+ */
+static int segments_in_request(const Message &request) {
+    Message copy = request;
+    int segments_cnt = 0;
+
+    int ranges_cnt = copy.read_int();
+    for (int i = 0; i < ranges_cnt; i++) {
+        copy.read_int();
+        segments_cnt += copy.read_int();
+    }
+
+    return segments_cnt;
+}
+
+
+/*
+ * Hands a request to the workers, unless the choke scheduler refuses it or
+ * the rate limit holds it back (upload thread only).
+ */
+void Client::dispatch_upload_job(UploadJob &job) {
+    const MessageHeader &header = job.request.header;
+
+    if (this->choke) {
+        if (header.type == NOT_INTERESTED && header.file == -1) {
+            forget_downloader(job.peer);
+            return;
+        }
+
+        if (header.type == BITFIELD_REQ || header.type == GET_SEGMENTS) {
+            note_interest(job.peer, header.file);
+        } else if (header.type == NOT_INTERESTED) {
+            drop_interest(job.peer, header.file);
+        }
+    }
+
+    // The subscriptions change here, in the order the messages of the peer
+    // arrived, so a NOT_INTERESTED is never undone by an earlier BITFIELD_REQ
+    // that a worker serves after it.
+    if (header.type == BITFIELD_REQ) {
+        subscribe_peer(job.peer, header.file);
+    } else if (header.type == NOT_INTERESTED) {
+        unsubscribe_peer(job.peer, header.file);
+        return;
+    }
+
+    if (header.type == GET_SEGMENTS) {
+        UploadPeer &peer = this->upload_peers[job.peer];
+
+        if (this->choke && peer.choked) {
+            refuse_upload_job(job.peer, header, CHOKE);
+            return;
+        }
+
+        // The requests of a peer wait for tokens in order.
+        if (this->upload_rate > 0 && (!peer.throttled.empty()
+                                      || !peer.bucket.take(segments_in_request(job.request), MPI_Wtime()))) {
+            peer.throttled.push_back(move(job));
+            this->choke_stats.throttled_requests++;
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&this->upload_jobs_mutex);
+
+    if (header.type == CANCEL) {
+        // Drop the cancelled request if no worker has taken it yet.
+        cancel_upload_job(job.peer, header.value);
+    } else {
+        this->upload_jobs.push_back(move(job));
+        pthread_cond_signal(&this->upload_jobs_cond);
+    }
+
+    pthread_mutex_unlock(&this->upload_jobs_mutex);
+}
+
+
+void Client::schedule_uploads() {
+    double now = MPI_Wtime();
+
+    if (this->choke && now >= this->next_rechoke) {
+        rechoke();
+        this->next_rechoke = now + CHOKE_INTERVAL;
+    }
+
+    if (this->upload_rate > 0) {
+        release_throttled_jobs(now);
+    }
+}
+
+
+/*
+ * A peer asked for (part of) a file. A peer that was not interested takes a
+ * free unchoke slot right away, or is choked until a rechoke picks it.
+ */
+void Client::note_interest(int peer_idx, int file) {
+    UploadPeer &peer = this->upload_peers[peer_idx];
+    bool interested = !peer.files.empty();
+
+    peer.files.insert(file);
+    peer.known = true;
+
+    if (interested) {
+        return;
+    }
+
+    int unchoked = 0;
+    for (int other = 0; other < this->numtasks; other++) {
+        const UploadPeer &other_peer = this->upload_peers[other];
+
+        if (other != peer_idx && !other_peer.files.empty() && !other_peer.choked) {
+            unchoked++;
+        }
+    }
+
+    set_choked(peer_idx, unchoked >= this->unchoke_slots);
+}
+
+
+/*
+ * The slot of a peer interested in nothing anymore is free for the others,
+ * though it is only choked at the next rechoke.
+ */
+void Client::drop_interest(int peer_idx, int file) {
+    this->upload_peers[peer_idx].files.erase(file);
+}
+
+
+/*
+ * The peer will not ask for anything anymore: answer with a last CHOKE, after
+ * which nothing is sent to it.
+ */
+void Client::forget_downloader(int peer_idx) {
+    refuse_upload_jobs(peer_idx);
+
+    UploadPeer &peer = this->upload_peers[peer_idx];
+    peer.files.clear();
+    peer.known = false;
+    peer.choked = false;
+
+    Message(CHOKE, -1, 0, 1).send(peer_idx, DOWNLOAD_TAG);
+}
+
+
+/*
+ * Tit-for-tat: the interested peers that uploaded the most to this client
+ * during the last interval (then the ones it served the most, for a seed) get
+ * all the unchoke slots but one. The last one goes to a choked peer, in turn,
+ * so every peer is eventually unchoked and new peers can show what they give.
+ */
+void Client::rechoke() {
+    this->choke_stats.rechokes++;
+
+    vector<int> interested;
+    for (int peer_idx = this->trackers; peer_idx < this->numtasks; peer_idx++) {
+        UploadPeer &peer = this->upload_peers[peer_idx];
+
+        int received = this->received_from[peer_idx].load();
+        int served = this->served_to[peer_idx].load();
+        peer.received_rate = received - peer.received_mark;
+        peer.served_rate = served - peer.served_mark;
+        peer.received_mark = received;
+        peer.served_mark = served;
+
+        if (!peer.files.empty()) {
+            interested.push_back(peer_idx);
+        }
+    }
+
+    stable_sort(interested.begin(), interested.end(), [this](int a, int b) {
+        const UploadPeer &first = this->upload_peers[a];
+        const UploadPeer &second = this->upload_peers[b];
+
+        if (first.received_rate != second.received_rate) {
+            return first.received_rate > second.received_rate;
+        }
+
+        return first.served_rate > second.served_rate;
+    });
+
+    vector<bool> unchoked(this->numtasks, false);
+    int regular = min((int) interested.size(), this->unchoke_slots - 1);
+    for (int i = 0; i < regular; i++) {
+        unchoked[interested[i]] = true;
+    }
+
+    // The optimistic unchoke moves on every OPTIMISTIC_ROUNDS rechokes, or as
+    // soon as its peer is not a candidate anymore.
+    if ((int) interested.size() > regular) {
+        int current = this->optimistic_peer;
+        bool valid = current != -1 && !this->upload_peers[current].files.empty() && !unchoked[current];
+
+        if (!valid || this->choke_stats.rechokes % OPTIMISTIC_ROUNDS == 0) {
+            int start = max(current, 0);
+
+            for (int k = 1; k <= this->numtasks; k++) {
+                int candidate = (start + k) % this->numtasks;
+
+                if (!this->upload_peers[candidate].files.empty() && !unchoked[candidate]) {
+                    this->optimistic_peer = candidate;
+                    break;
+                }
+            }
+
+            if (this->optimistic_peer != current) {
+                this->choke_stats.optimistic_unchokes++;
+            }
+        }
+
+        unchoked[this->optimistic_peer] = true;
+    }
+
+    for (int peer_idx = this->trackers; peer_idx < this->numtasks; peer_idx++) {
+        if (this->upload_peers[peer_idx].known) {
+            set_choked(peer_idx, !unchoked[peer_idx]);
+        }
+    }
+}
+
+
+/*
+ * Tells the peer when its choke state changes. A choked peer gets its queued
+ * requests back, refused.
+ */
+void Client::set_choked(int peer_idx, bool choked) {
+    UploadPeer &peer = this->upload_peers[peer_idx];
+
+    if (peer.choked == choked) {
+        return;
+    }
+    peer.choked = choked;
+
+    Message(choked ? CHOKE : UNCHOKE, -1, 0, 0).send(peer_idx, DOWNLOAD_TAG);
+
+    if (choked) {
+        this->choke_stats.chokes_sent++;
+        refuse_upload_jobs(peer_idx);
+    } else {
+        this->choke_stats.unchokes_sent++;
+    }
+}
+
+
+void Client::release_throttled_jobs(double now) {
+    vector<UploadJob> released;
+
+    for (auto &peer : this->upload_peers) {
+        while (!peer.throttled.empty() && peer.bucket.take(segments_in_request(peer.throttled.front().request),
+                                                           now)) {
+            released.push_back(move(peer.throttled.front()));
+            peer.throttled.pop_front();
+        }
+    }
+
+    if (released.empty()) {
+        return;
+    }
+
+    pthread_mutex_lock(&this->upload_jobs_mutex);
+    for (UploadJob &job : released) {
+        this->upload_jobs.push_back(move(job));
+    }
+    pthread_cond_broadcast(&this->upload_jobs_cond);
+    pthread_mutex_unlock(&this->upload_jobs_mutex);
+}
+
+
+/*
+ * Answers a GET_SEGMENTS that will not be served, so the requester still gets
+ * exactly one reply for it.
+ */
+void Client::refuse_upload_job(int peer_idx, const MessageHeader &header, int type) {
+    Message response(type, header.segment_idx, this->load.load());
+    response.send(peer_idx, header.value);
+
+    if (type == CHOKE) {
+        this->choke_stats.refused_requests++;
+    }
+}
+
+
+/*
+ * Refuses the requests of a peer not taken by a worker yet: the queued ones
+ * and the ones waiting for tokens.
+ */
+void Client::refuse_upload_jobs(int peer_idx) {
+    pthread_mutex_lock(&this->upload_jobs_mutex);
+
+    auto it = this->upload_jobs.begin();
+    while (it != this->upload_jobs.end()) {
+        if (it->peer == peer_idx && it->request.header.type == GET_SEGMENTS) {
+            refuse_upload_job(peer_idx, it->request.header, CHOKE);
+            it = this->upload_jobs.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    pthread_mutex_unlock(&this->upload_jobs_mutex);
+
+    UploadPeer &peer = this->upload_peers[peer_idx];
+    for (const UploadJob &job : peer.throttled) {
+        refuse_upload_job(peer_idx, job.request.header, CHOKE);
+    }
+    peer.throttled.clear();
+}
+
+
+/*
+ * Called with upload_jobs_mutex held. A request that is still queued (or
+ * waiting for tokens) is removed and answered with a NACK, so the requester
+ * still gets exactly one reply for it. Requests already taken by a worker are
+ * left alone.
+ */
+void Client::cancel_upload_job(int peer_idx, int reply_tag) {
+    for (auto it = this->upload_jobs.begin(); it != this->upload_jobs.end(); it++) {
+        const MessageHeader &header = it->request.header;
+
+        if (it->peer == peer_idx && header.type == GET_SEGMENTS && header.value == reply_tag) {
+            refuse_upload_job(peer_idx, header, NACK);
+
+            this->upload_jobs.erase(it);
+            return;
+        }
+    }
+
+    deque<UploadJob> &throttled = this->upload_peers[peer_idx].throttled;
+    for (auto it = throttled.begin(); it != throttled.end(); it++) {
+        if (it->request.header.value == reply_tag) {
+            refuse_upload_job(peer_idx, it->request.header, NACK);
+
+            throttled.erase(it);
+            return;
+        }
+    }
+}
+
+
+void Client::serve_upload_job(UploadJob &job) {
+    Message &request = job.request;
+
+    switch (request.header.type) {
+        case BITFIELD_REQ:
+            handle_bitfield_req_from_peer(job.peer, request.header.file);
+            break;
+
+        case GET_SEGMENTS:
+            handle_get_segments_req_from_peer(job.peer, request);
+            break;
+    }
+}
+
+
+/*
+ * Upload thread only. The peer gets a HAVE for every segment completed from
+ * now on, so one completed after the snapshot of its bitfield reaches it too.
+ */
+void Client::subscribe_peer(int peer_idx, int file) {
+    pthread_mutex_lock(&this->subscribers_mutex);
+    vector<int> &peers = this->subscribers[file];
+    if (find(peers.begin(), peers.end(), peer_idx) == peers.end()) {
+        peers.push_back(peer_idx);
+        this->subscribers_versions[file].fetch_add(1, memory_order_release);
+    }
+    pthread_mutex_unlock(&this->subscribers_mutex);
+}
+
+
+void Client::unsubscribe_peer(int peer_idx, int file) {
+    pthread_mutex_lock(&this->subscribers_mutex);
+    vector<int> &peers = this->subscribers[file];
+    auto it = find(peers.begin(), peers.end(), peer_idx);
+    if (it != peers.end()) {
+        peers.erase(it);
+        this->subscribers_versions[file].fetch_add(1, memory_order_release);
+    }
+    pthread_mutex_unlock(&this->subscribers_mutex);
+}
+
+
+void Client::handle_bitfield_req_from_peer(int peer_idx, int file) {
+    // The peer was subscribed when the request was dispatched. A file that is
+    // not known yet is answered with an empty bitfield.
+    Bitfield *bitfield = this->owned_segments[file].load(memory_order_acquire);
+
+    Message response(BITFIELD, file, 0, 0);
+
+    if (bitfield != NULL) {
+        vector<uint64_t> words;
+        bitfield->snapshot(words);
+
+        response.header.value = bitfield->get_size();
+        response.append(words.data(), words.size() * sizeof(uint64_t));
+    }
+
+    // Peer exchange: the other downloaders of the file this client knows of.
+    response.append_int_vector(pex_members(file, peer_idx));
+
+    response.send(peer_idx, DOWNLOAD_TAG);
+}
+
+
+void Client::handle_get_segments_req_from_peer(int peer_idx, Message &request) {
+    // The segments come as (first index, count) ranges.
+    int segments_cnt = 0;
+    int ranges_cnt = request.read_int();
+    vector<int> ranges(2 * ranges_cnt);
+    request.read(ranges.data(), ranges.size() * sizeof(int));
+    for (int i = 0; i < ranges_cnt; i++) {
+        segments_cnt += ranges[2 * i + 1];
+    }
+
+    int reply_tag = request.header.value;
+
+    // Payload mode: send the bytes straight from the mapped file, before the ACK.
+    if (this->payload) {
+        char *data = this->file_data[request.header.file].load(memory_order_acquire);
+
+        MPI_Datatype type = segments_datatype(ranges);
+        MPI_Send(data, 1, type, peer_idx, DATA_TAG_BASE + reply_tag - REPLY_TAG_BASE, MPI_COMM_WORLD);
+        MPI_Type_free(&type);
+    }
+
+    // Add load to the client, one unit per segment (several workers may
+    // serve at the same time).
+    int load = this->load.fetch_add(segments_cnt) + segments_cnt;
+    this->served_to[peer_idx] += segments_cnt;
+
+    // Send a single response for the whole batch to the peer (simulate the
+    // sending of the segments), on the tag the peer chose for this request.
+    // The load of the client travels with it, so the peer never has to ask for it.
+    Message response(ACK, segments_cnt, load);
+    response.send(peer_idx, reply_tag);
+}
+
+
+void Client::announce_tracker_whole_file_received(int file) {
+    // Notify the tracker that the client is now a seed of the file.
+    Message msg(FILE_DOWNLOAD_COMPLETE, file, 0, 0);
+    send_to_tracker(msg, tracker_of(file, this->trackers));
+}
+
+
+/*
+ * The tracker posts fixed-size receives (TRACKER_REQ_SIZE). A larger request
+ * is announced by a LARGE_REQUEST with its size, then sent on its own tag.
+ */
+void Client::send_to_tracker(const Message &msg, int tracker) {
+    if (msg.size() <= TRACKER_REQ_SIZE) {
+        msg.send(tracker, TRACKER_TAG);
+        return;
+    }
+
+    Message announce(LARGE_REQUEST, 0, msg.size());
+    announce.send(tracker, TRACKER_TAG);
+    msg.send(tracker, TRACKER_LARGE_TAG);
+}
+
+
+void Client::save_file(int file) {
+    ofstream out_file("client" + to_string(this->rank) + "_" + this->file_names[file]);
+
+    // Segments may have been received in any order; write them in index order.
+    const SegmentTable &segments = this->owned_files[file];
+
+    vector<int> order(segments.size());
+    for (int i = 0; i < segments.size(); i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&segments](int a, int b) {
+        return segments.indices[a] < segments.indices[b];
+    });
+
+    for (int i = 0; i < segments.size(); i++) {
+        out_file << digest_to_hex(segments.digests[order[i]]);
+
+        if (i + 1 != segments.size()) {
+            out_file << "\n";
+        }
+    }
+
+    out_file.close();
+}
+
+
+void Client::announce_tracker_all_files_received() {
+    // Notify every tracker that the client has no more files to download (and
+    // thus no more requests for it).
+    Message msg(ALL_FILES_RECEIVED);
+    for (int tracker = 0; tracker < this->trackers; tracker++) {
+        msg.send(tracker, TRACKER_TAG);
+    }
 }
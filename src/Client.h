@@ -5,22 +5,323 @@
 #include <unordered_map>
 #include <vector>
 #include <unordered_set>
+#include <list>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <memory>
 #include <pthread.h>
 #include "helper_objects.h"
+#include "Message.h"
+#include "constants.h"
+
+
+// The bytes of a segment in the staging buffer of a request.
+struct StagedSegment {
+    std::shared_ptr<std::vector<char>> staging;
+    size_t offset;
+};
+
+
+// Download state of a wanted file.
+struct FileSession {
+    int file;
+    std::vector<int> swarm;
+    int swarm_version;
+
+    // Which ranks are in the swarm above, and the version of the subscribers
+    // of the file last gossiped (peer exchange).
+    std::vector<bool> in_swarm;
+    int gossiped_version;
+    SegmentTable segments;
+    Bitfield *bitfield;
+
+    // Peers asked for their bitfield or for segments of this file, told
+    // NOT_INTERESTED once it is complete.
+    std::unordered_set<int> contacted;
+
+    // Segments (by index) not requested yet, bucketed by their known owners,
+    // and the position in the segment table of each segment index.
+    PendingSegments pending;
+    std::vector<int> position_of;
+
+    // Received segments not reported to the tracker yet (replica index only).
+    std::vector<int> unreported;
+
+    // Verification: positions received but not hashed yet, and the peers that
+    // sent a corrupt copy of a position (not asked for it again).
+    std::unordered_set<int> verifying;
+    std::unordered_map<int, std::vector<int>> corrupt_from;
+
+    // Payload mode: positions received through a copy of their request, whose
+    // bytes wait in its staging buffer until the receive posted in place (in
+    // the mapped file) by another copy has ended.
+    std::unordered_map<int, StagedSegment> landing;
+
+    // Request slots in flight for each position (more than one in endgame).
+    std::unordered_map<int, std::vector<int>> in_flight_slots;
+
+    // Payload mode: the mapped data of the file, received in place.
+    char *data;
+
+    double start_time;
+    int received;
+    int in_flight;
+};
+
+
+// A GET_SEGMENTS in flight, in its request slot.
+struct SegmentRequest {
+    FileSession *session;
+    int peer;
+    std::vector<int> positions;
+    double start_time;
+    double deadline;
+    bool timed_out;
+    char reply_buff[MAX_REPLY_SIZE];
+    std::vector<char> send_buff;
+    MPI_Request send_request;
+
+    // Payload mode: the receive of the segment bytes, in place in the mapped
+    // file, or in the staging buffer. With verification they are always
+    // staged, and copied to the file once their hash matches. Without it, only
+    // the first request of a segment receives in place: no two receives ever
+    // write the same bytes of the file.
+    MPI_Request data_request = MPI_REQUEST_NULL;
+    bool in_place;
+    std::shared_ptr<std::vector<char>> staging;
+};
+
+
+// A received segment waiting for a verifier, then for the download thread.
+struct VerifyJob {
+    FileSession *session;
+    int position;
+    int peer;
+    std::shared_ptr<std::vector<char>> staging;
+    size_t offset;
+    bool valid;
+};
+
+
+// A request received by the upload thread, waiting for an upload worker.
+struct UploadJob {
+    int peer;
+    Message request;
+};
+
+
+// Counters of the endgame mode and of the request timeouts, used to tune them.
+struct EndgameStats {
+    int endgame_requests = 0;
+    int endgame_positions = 0;
+    int cancels_sent = 0;
+    int cancelled_requests = 0;
+    int duplicate_segments = 0;
+    int timeouts = 0;
+    int requeued_positions = 0;
+    int pex_learned = 0;
+    int pex_sent = 0;
+    int who_has_sent = 0;
+    long payload_bytes = 0;
+    int corrupt_segments = 0;
+    int received_segments = 0;
+    int chokes_received = 0;
+    int choked_requests = 0;
+};
+
+
+// What a downloader measured about a peer.
+struct PeerStats {
+    double latency = 0;
+    int replies = 0;
+    int timeouts = 0;
+
+    // Last load piggybacked on a reply of the peer, and when it arrived.
+    int load = 0;
+    double load_time = 0;
+
+    // Whether the peer chokes this client (CHOKE, until an UNCHOKE).
+    bool choked = false;
+};
+
+
+// What the upload thread knows about a downloader (choke scheduler and rate limit).
+struct UploadPeer {
+    // Files the peer asked for and did not give up yet; it is interested while
+    // this is not empty. known: it asked for something and did not leave yet.
+    std::unordered_set<int> files;
+    bool known = false;
+
+    // The choke state, as last sent to the peer (not choked until told so).
+    bool choked = false;
+
+    // Segments received from and served to the peer, at the last rechoke, and
+    // during the interval before it.
+    int received_mark = 0;
+    int served_mark = 0;
+    int received_rate = 0;
+    int served_rate = 0;
+
+    // Rate limit, and the requests waiting for tokens, in order.
+    TokenBucket bucket;
+    std::deque<UploadJob> throttled;
+};
+
+
+// Counters of the choke scheduler and of the rate limit (upload thread only).
+struct ChokeStats {
+    int rechokes = 0;
+    int chokes_sent = 0;
+    int unchokes_sent = 0;
+    int optimistic_unchokes = 0;
+    int refused_requests = 0;
+    int throttled_requests = 0;
+};
 
 
 class Client {
  public:
     int numtasks;
+    int trackers;
     int rank;
-    int load;
-    pthread_mutex_t owned_files_mutex;
+    // Segments sent so far, incremented by all the upload workers.
+    std::atomic<int> load;
+    bool print_stats;
+
+    // Files are named by the IDs their trackers assign at bootstrap, and the
+    // state of a file is at its ID in each of the tables below, all sized to
+    // the file_cnt IDs of the network before the threads start.
+    int file_cnt;
+
+    // Owned files as read from the input file, until their IDs are known.
+    std::vector<std::pair<std::string, SegmentTable>> input_files;
+
+    // Only touched by the main thread (before the start) and the download
+    // thread. A wanted file gets its name here once its ID is known.
+    std::vector<std::string> file_names;
+    std::vector<SegmentTable> owned_files;
+    std::vector<std::string> wanted_files;
+
+    // Segment possession, read by the upload thread without a lock. The bitfield
+    // of a file not owned stays NULL until the download thread learns its
+    // segment count and publishes it.
+    std::vector<std::atomic<Bitfield *>> owned_segments;
+
+    // Payload mode: the data of each file, mapped in memory. The address of a
+    // wanted file is published (release) before its bitfield.
+    bool payload;
+    size_t segment_size;
+    std::vector<std::atomic<char *>> file_data;
+    std::vector<size_t> file_data_sizes;
+
+    // Verification: received segments queued for the verifiers, and the
+    // verified ones queued back for the download thread, both under
+    // verify_mutex. verifications counts the jobs not collected yet (download
+    // thread only).
+    bool verify;
+    int verifiers;
+    std::deque<VerifyJob> verify_jobs;
+    std::deque<VerifyJob> verified_jobs;
+    pthread_mutex_t verify_mutex;
+    pthread_cond_t verify_cond;
+    bool verify_stopping;
+    int verifications;
+    long hashed_segments;
+    double hashing_time;
+
+    // Peers that asked for the bitfield of a file and must be sent a HAVE
+    // for each newly completed segment (written by the upload thread), and
+    // the number of changes of each list, so the download thread only looks
+    // at a list that changed.
+    std::vector<std::vector<int>> subscribers;
+    std::vector<std::atomic<int>> subscribers_versions;
+    pthread_mutex_t subscribers_mutex;
+
+    // Requests dispatched by the upload thread to its pool of workers.
+    std::deque<UploadJob> upload_jobs;
+    pthread_mutex_t upload_jobs_mutex;
+    pthread_cond_t upload_jobs_cond;
+    bool upload_stopping;
+    int upload_workers;
+
+    // Download thread only: the files being downloaded, and the segments owned
+    // by each peer for each of them.
+    std::vector<bool> downloading;
+    std::vector<Availability> availability;
+
+    // Download thread only: notifications still in flight, with their buffers.
+    std::vector<MPI_Request> notification_requests;
+    std::vector<std::vector<char>> notification_buffers;
+    int stops_received;
+
+    // Download thread only: BITFIELD replies not received yet, all waited for
+    // before ALL_FILES_RECEIVED.
+    int bitfields_pending;
+
+    // Download thread only: files whose swarm changed since it was last asked for.
+    std::vector<bool> stale_swarms;
+
+    // Download thread only: swarm members learned from other clients, per file.
+    bool pex;
+    std::vector<std::unordered_set<int>> discovered;
+
+    // Download thread only: with the replica index, the owners of the segments
+    // are asked from the tracker (one WHO_HAS in flight per file). The time
+    // of the last query for segments with known owners, and their number.
+    bool replica_index;
+    std::vector<bool> who_has_pending;
+    std::vector<double> who_has_time;
+    std::vector<int> who_has_rounds;
+
+    // Download thread only: the segment request pipeline. slots[i] is waiting for its
+    // reply through reply_requests[i] (MPI_REQUEST_NULL while the slot is free).
+    std::vector<SegmentRequest> slots;
+    std::vector<MPI_Request> reply_requests;
+    std::vector<int> free_slots;
+    std::unordered_map<int, int> peer_in_flight;
+    int in_flight;
+    int peer_window;
+    int segment_batch;
+
+    // Download thread only: what was measured about each peer (latency, load).
+    std::unordered_map<int, PeerStats> peer_stats;
+
+    // Number of wanted files downloaded at the same time.
+    int max_sessions;
+
+    // Segments received from and served to each rank, read by the choke
+    // scheduler (written by the download thread and the upload workers).
+    std::vector<std::atomic<int>> received_from;
+    std::vector<std::atomic<int>> served_to;
+
+    // Upload thread only: the choke scheduler and the rate limit of each peer.
+    bool choke;
+    int unchoke_slots;
+    double upload_rate;
+    std::vector<UploadPeer> upload_peers;
+    int optimistic_peer;
+    double next_rechoke;
+    ChokeStats choke_stats;
+
+    // Download thread only: peers whose upload thread knows this client, and
+    // the ones that did not answer its leaving yet (choke scheduler only).
+    std::unordered_set<int> known_uploaders;
+    int farewells_pending;
+
+    // Time the download thread took to get all the wanted files (reported to
+    // the first tracker once the threads are joined).
+    double download_time;
 
-    std::unordered_map<std::string, std::vector<Segment>> owned_files;
-    std::unordered_set<std::string> wanted_files;
+    // Download thread only: used for the random first segments of each file.
+    std::mt19937 rng;
 
+    // Number of in-flight segments left in a file below which it enters endgame.
+    int endgame_threshold;
+    EndgameStats stats;
 
-    Client(int numtasks, int rank);
+
+    Client(int numtasks, int rank, int trackers);
 
     ~Client();
 
@@ -30,27 +331,146 @@ class Client {
 
     void read_input_file();
 
+    void init_owned_segments();
+
+    char *map_file_data(int file, int segment_cnt, bool fill);
+
+    MPI_Datatype segments_datatype(const std::vector<int> &ranges);
+
     void send_owned_files_to_tracker();
 
-    void receive_file_details_from_tracker(const std::string &wanted_file, std::vector<int> &swarm,
-                                           std::vector<Segment> &segments);
+    void download_files();
+
+    bool start_session(FileSession &session, const std::string &wanted_file);
+
+    void finish_session(FileSession &session);
+
+    bool issue_segment_request(FileSession &session);
+
+    bool issue_endgame_request(FileSession &session);
+
+    void send_segment_request(FileSession &session, const std::vector<int> &positions, int peer);
+
+    void complete_position(FileSession &session, int slot, int position, bool served);
+
+    void complete_segment_request(int slot, MPI_Status &status);
+
+    void receive_segment(FileSession &session, int position);
+
+    bool has_arrived(const FileSession &session, int position);
+
+    StagedSegment staged_segment(int slot, int position);
+
+    void land_segment(FileSession &session, int position, const StagedSegment &segment);
+
+    void verify_segment(FileSession &session, int slot, int position);
+
+    void verify_jobs_batch(std::vector<VerifyJob> &jobs);
+
+    int collect_verified_segments();
+
+    void benchmark_md5();
+
+    double request_timeout(int peer);
+
+    int check_request_deadlines();
+
+    void requeue_position(FileSession &session, int position);
+
+    bool has_incoming_message();
+
+    bool receive_file_details_from_tracker(FileSession &session, const std::string &file_name);
+
+    void unpack_file_swarm(Message &reply, std::vector<int> &swarm);
+
+    void unpack_file_segment_details(Message &reply, SegmentTable &segments);
+
+    void update_swarm_from_tracker(FileSession &session);
+
+    void exchange_swarm_members(FileSession &session);
+
+    bool add_swarm_member(FileSession &session, int member);
+
+    void set_swarm_members(FileSession &session);
+
+    std::vector<int> pex_members(int file, int except);
+
+    void report_segment(FileSession &session, int segment_idx);
 
-    void receive_file_swarm_from_tracker(std::vector<int> &swarm);
+    void send_segments_report(FileSession &session);
 
-    void receive_file_segment_details_from_tracker(std::vector<Segment> &segments);
+    void ask_segment_owners(FileSession &session);
 
-    void update_swarm_from_tracker(const std::string &wanted_file, std::vector<int> &swarm);
+    void request_bitfields(int file, const std::vector<int> &swarm, std::unordered_set<int> &contacted);
 
-    int get_peer_with_min_load_for_segment(const std::string &file, int segment_idx,
-                                           std::vector<int> &swarm);
+    int choose_peer_for_segment(int file, int segment_idx,
+                                const std::vector<int> &excluded = std::vector<int>());
 
-    void handle_has_segment_req_from_peer(int peer_idx);
+    int choose_peer_for_position(FileSession &session, int position);
 
-    void handle_get_segment_req_from_peer(int peer_idx);
+    bool has_free_owner(int file);
 
-    void announce_tracker_whole_file_received(const std::string &file);
+    bool all_owners_known(int file);
 
-    void save_file(const std::string &file);
+    int estimated_load(int peer);
+
+    Message wait_for_reply(int &source);
+
+    void wait_for_notification(int source);
+
+    bool handle_notification(const Message &msg, int source);
+
+    void announce_have(int file, int segment_idx);
+
+    void notify(const Message &msg, int dest, int tag);
+
+    void progress_notifications();
+
+    void drain_notifications();
+
+    void flush_notifications();
+
+    void wait_for_stop();
+
+    void leave_uploaders();
+
+    void dispatch_upload_job(UploadJob &job);
+
+    void schedule_uploads();
+
+    void note_interest(int peer_idx, int file);
+
+    void drop_interest(int peer_idx, int file);
+
+    void forget_downloader(int peer_idx);
+
+    void rechoke();
+
+    void set_choked(int peer_idx, bool choked);
+
+    void release_throttled_jobs(double now);
+
+    void refuse_upload_job(int peer_idx, const MessageHeader &header, int type);
+
+    void refuse_upload_jobs(int peer_idx);
+
+    void cancel_upload_job(int peer_idx, int reply_tag);
+
+    void serve_upload_job(UploadJob &job);
+
+    void handle_bitfield_req_from_peer(int peer_idx, int file);
+
+    void subscribe_peer(int peer_idx, int file);
+
+    void unsubscribe_peer(int peer_idx, int file);
+
+    void handle_get_segments_req_from_peer(int peer_idx, Message &request);
+
+    void announce_tracker_whole_file_received(int file);
+
+    void send_to_tracker(const Message &msg, int tracker);
+
+    void save_file(int file);
 
     void announce_tracker_all_files_received();
 };
@@ -60,5 +480,9 @@ void *download_thread_func(void *arg);
 
 void *upload_thread_func(void *arg);
 
+void *upload_worker_func(void *arg);
+
+void *verifier_func(void *arg);
+
 
 #endif /* CLIENT_H */
@@ -0,0 +1,216 @@
+#include "Message.h"
+
+#include <cstring>
+
+using namespace std;
+
+
+Message::Message() : Message(0) {}
+
+
+Message::Message(int type, int segment_idx, int value) {
+    this->header.type = type;
+    this->header.file = -1;
+    this->header.segment_idx = segment_idx;
+    this->header.value = value;
+    this->read_pos = 0;
+}
+
+
+Message::Message(int type, int file, int segment_idx, int value) : Message(type, segment_idx, value) {
+    this->header.file = file;
+}
+
+
+Message::Message(int type, const std::string &file_name, int segment_idx, int value)
+    : Message(type, segment_idx, value) {
+    this->file_name = file_name;
+}
+
+
+void Message::append(const void *data, size_t size) {
+    const char *bytes = (const char *) data;
+    this->payload.insert(this->payload.end(), bytes, bytes + size);
+}
+
+
+void Message::append_int(int value) {
+    append(&value, sizeof(int));
+}
+
+
+void Message::append_int_vector(const std::vector<int> &values) {
+    append_int(values.size());
+    append(values.data(), values.size() * sizeof(int));
+}
+
+
+void Message::append_string(const std::string &value) {
+    append_int(value.size());
+    append(value.data(), value.size());
+}
+
+
+void Message::append_segment_table(const SegmentTable &segments) {
+    // The count, then all the raw digests, then all the indices.
+    append_int(segments.size());
+    append(segments.digests.data(), segments.size() * sizeof(Digest));
+    append(segments.indices.data(), segments.size() * sizeof(int));
+}
+
+
+void Message::read(void *data, size_t size) {
+    memcpy(data, this->payload.data() + this->read_pos, size);
+    this->read_pos += size;
+}
+
+
+int Message::read_int() {
+    int value;
+    read(&value, sizeof(int));
+    return value;
+}
+
+
+void Message::read_int_vector(std::vector<int> &values) {
+    int cnt = read_int();
+    values.resize(cnt);
+    read(values.data(), cnt * sizeof(int));
+}
+
+
+std::string Message::read_string() {
+    int len = read_int();
+    string value(this->payload.data() + this->read_pos, len);
+    this->read_pos += len;
+    return value;
+}
+
+
+void Message::read_segment_table(SegmentTable &segments) {
+    int cnt = read_int();
+
+    segments.digests.resize(cnt);
+    read(segments.digests.data(), cnt * sizeof(Digest));
+
+    segments.indices.resize(cnt);
+    read(segments.indices.data(), cnt * sizeof(int));
+}
+
+
+void Message::send(int dest, int tag) const {
+    vector<char> buff;
+    serialize(buff);
+
+    MPI_Send(buff.data(), buff.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD);
+}
+
+
+/*
+ * Non-blocking send. The caller keeps buff alive until the request completes.
+ */
+void Message::isend(int dest, int tag, std::vector<char> &buff, MPI_Request *request) const {
+    serialize(buff);
+
+    MPI_Isend(buff.data(), buff.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD, request);
+}
+
+
+/*
+ * Synchronous-mode, non-blocking send: the request only completes once the
+ * destination has started receiving the message. The caller keeps buff alive
+ * until then.
+ */
+void Message::issend(int dest, int tag, std::vector<char> &buff, MPI_Request *request) const {
+    serialize(buff);
+
+    MPI_Issend(buff.data(), buff.size(), MPI_BYTE, dest, tag, MPI_COMM_WORLD, request);
+}
+
+
+void Message::recv(int source, int tag, MPI_Status *status) {
+    // Match the message first, so no other thread can receive it
+    // between the size query and the actual receive.
+    MPI_Message handle;
+    MPI_Status probe_status;
+    MPI_Mprobe(source, tag, MPI_COMM_WORLD, &handle, &probe_status);
+
+    recv_matched(handle, probe_status, status);
+}
+
+
+bool Message::try_recv(int source, int tag, MPI_Status *status) {
+    int found;
+    MPI_Message handle;
+    MPI_Status probe_status;
+    MPI_Improbe(source, tag, MPI_COMM_WORLD, &found, &handle, &probe_status);
+
+    if (!found) {
+        return false;
+    }
+
+    recv_matched(handle, probe_status, status);
+    return true;
+}
+
+
+void Message::recv_matched(MPI_Message &handle, MPI_Status &probe_status, MPI_Status *status) {
+    int size;
+    MPI_Get_count(&probe_status, MPI_BYTE, &size);
+
+    vector<char> buff(size);
+    MPI_Mrecv(buff.data(), size, MPI_BYTE, &handle, MPI_STATUS_IGNORE);
+
+    if (status != MPI_STATUS_IGNORE) {
+        *status = probe_status;
+    }
+
+    deserialize(buff.data(), size);
+}
+
+
+/*
+ * Size of the message on the wire.
+ */
+size_t Message::size() const {
+    return sizeof(MessageHeader) + sizeof(int) + this->file_name.size() + this->payload.size();
+}
+
+
+void Message::serialize(std::vector<char> &buff) const {
+    int name_len = this->file_name.size();
+
+    buff.resize(size());
+    char *pos = buff.data();
+
+    memcpy(pos, &this->header, sizeof(MessageHeader));
+    pos += sizeof(MessageHeader);
+
+    memcpy(pos, &name_len, sizeof(int));
+    pos += sizeof(int);
+
+    memcpy(pos, this->file_name.data(), name_len);
+    pos += name_len;
+
+    if (!this->payload.empty()) {
+        memcpy(pos, this->payload.data(), this->payload.size());
+    }
+}
+
+
+void Message::deserialize(const char *data, int size) {
+    const char *pos = data;
+
+    memcpy(&this->header, pos, sizeof(MessageHeader));
+    pos += sizeof(MessageHeader);
+
+    int name_len;
+    memcpy(&name_len, pos, sizeof(int));
+    pos += sizeof(int);
+
+    this->file_name.assign(pos, name_len);
+    pos += name_len;
+
+    this->payload.assign(pos, data + size);
+    this->read_pos = 0;
+}
@@ -0,0 +1,90 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
+#include <mpi.h>
+#include <string>
+#include <vector>
+#include "helper_objects.h"
+
+
+/*
+ * Fixed part of every message exchanged by the clients and the tracker.
+ * The meaning of segment_idx and value depends on the type (see constants.h).
+ * file is the ID of the file the message is about (-1 for none).
+ */
+struct MessageHeader {
+    int type;
+    int file;
+    int segment_idx;
+    int value;
+};
+
+
+/*
+ * A logical request or response, sent as a single MPI message:
+ *      [header][file name length][file name][payload]
+ *
+ * Files are named by their ID in the header; only a FILE_DETAILS_REQ (asking
+ * for the ID of a wanted file) carries the file name. The receiver sizes its
+ * buffer using a matched probe, so variable-length fields (file name,
+ * payload) never need a separate message.
+ */
+class Message {
+ public:
+    MessageHeader header;
+    std::string file_name;
+    std::vector<char> payload;
+
+    // Position of the next unread payload byte.
+    size_t read_pos;
+
+    Message();
+
+    explicit Message(int type, int segment_idx = 0, int value = 0);
+
+    Message(int type, int file, int segment_idx, int value);
+
+    Message(int type, const std::string &file_name, int segment_idx = 0, int value = 0);
+
+    void append(const void *data, size_t size);
+
+    void append_int(int value);
+
+    void append_int_vector(const std::vector<int> &values);
+
+    void append_string(const std::string &value);
+
+    void append_segment_table(const SegmentTable &segments);
+
+    void read(void *data, size_t size);
+
+    int read_int();
+
+    void read_int_vector(std::vector<int> &values);
+
+    std::string read_string();
+
+    void read_segment_table(SegmentTable &segments);
+
+    size_t size() const;
+
+    void send(int dest, int tag) const;
+
+    void isend(int dest, int tag, std::vector<char> &buff, MPI_Request *request) const;
+
+    void issend(int dest, int tag, std::vector<char> &buff, MPI_Request *request) const;
+
+    void recv(int source, int tag, MPI_Status *status = MPI_STATUS_IGNORE);
+
+    bool try_recv(int source, int tag, MPI_Status *status = MPI_STATUS_IGNORE);
+
+    void deserialize(const char *data, int size);
+
+ private:
+    void serialize(std::vector<char> &buff) const;
+
+    void recv_matched(MPI_Message &handle, MPI_Status &probe_status, MPI_Status *status);
+};
+
+
+#endif /* MESSAGE_H */
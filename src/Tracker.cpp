@@ -1,183 +1,563 @@
 #include "Tracker.h"
 
 #include <mpi.h>
+#include <iostream>
+#include <cstdlib>
+#include <algorithm>
 #include "constants.h"
 
 using namespace std;
 
 
-Tracker::Tracker(int numtasks, int rank) {
+Tracker::Tracker(int numtasks, int rank, int trackers) {
     this->numtasks = numtasks;
     this->rank = rank;
+    this->trackers = trackers;
+    this->print_stats = getenv("BT_STATS") != NULL;
+    this->sent_bytes = 0;
+
+    this->replica_index = REPLICA_INDEX;
+    if (getenv("BT_REPLICA_INDEX") != NULL) {
+        this->replica_index = atoi(getenv("BT_REPLICA_INDEX")) != 0;
+    }
 }
 
 
 void Tracker::run() {
     initialize();
 
+    // Post a receive for every client, so a request is matched as soon as it
+    // arrives, whatever the client.
+    this->recv_requests.assign(this->numtasks, MPI_REQUEST_NULL);
+    this->recv_buffers.assign(this->numtasks, vector<char>(TRACKER_REQ_SIZE));
+    for (int client_idx = this->trackers; client_idx < this->numtasks; client_idx++) {
+        post_request_recv(client_idx);
+    }
+
     int finished_clients = 0;
-    bool should_stop = false;
-
-    // Handle client requests.
-    while (true) {
-        MPI_Status status;
-        int msg;
-
-        // Receive "Hello" message.
-        MPI_Recv(&msg, 1, MPI_INT, MPI_ANY_SOURCE, TRACKER_TAG, MPI_COMM_WORLD, &status);
-
-        switch (msg) {
-            case FILE_DETAILS_REQ:
-                handle_file_details_request(status.MPI_SOURCE);
-                break;
-
-            case UPDATE_SWARM_REQ:
-                handle_update_swarm_request(status.MPI_SOURCE);
-                break;
-
-            case FILE_DOWNLOAD_COMPLETE:
-                handle_file_download_complete_from_client(status.MPI_SOURCE);
-                break;
-
-            case ALL_FILES_RECEIVED:
-                finished_clients++;
-                if (finished_clients == this->numtasks - 1) {
-                    should_stop = true;
-                    announce_all_clients_to_stop();
-                }
-                break;
+    long handled_requests = 0;
+    double start_time = MPI_Wtime();
+
+    vector<int> done(this->numtasks);
+    vector<MPI_Status> statuses(this->numtasks);
+
+    // Handle client requests. Every client sends its ALL_FILES_RECEIVED to
+    // every tracker, after all its other requests, so each tracker knows on
+    // its own when no more requests can come.
+    int clients = this->numtasks - this->trackers;
+    while (finished_clients < clients) {
+        int done_cnt;
+        MPI_Waitsome(this->numtasks, this->recv_requests.data(), &done_cnt, done.data(),
+                     statuses.data());
+
+        for (int k = 0; k < done_cnt; k++) {
+            int client_idx = done[k];
+
+            int size;
+            MPI_Get_count(&statuses[k], MPI_BYTE, &size);
+
+            Message request;
+            request.deserialize(this->recv_buffers[client_idx].data(), size);
+
+            // Post the next receive before replying, so the requests of a
+            // client are matched in the order they were sent.
+            post_request_recv(client_idx);
+
+            handle_request(client_idx, request, finished_clients);
+            handled_requests++;
         }
 
-        if (should_stop) {
-            break;
+        // Complete the replies that were received meanwhile.
+        progress_replies();
+    }
+
+    if (this->print_stats) {
+        double elapsed = MPI_Wtime() - start_time;
+        cerr << "[tracker " << this->rank << "] " << handled_requests << " requests from "
+             << clients << " clients in " << elapsed << " s (" << handled_requests / elapsed
+             << " requests/s), " << this->sent_bytes << " bytes sent\n";
+    }
+
+    announce_all_clients_to_stop();
+    shutdown();
+
+    if (this->print_stats) {
+        report_load_balance();
+
+        if (this->rank == TRACKER_RANK) {
+            benchmark_swarm();
         }
     }
 }
 
 
-void Tracker::initialize() {
-    for (int client_idx = 1; client_idx < numtasks; client_idx++) {
-        recv_file_details_from_client(client_idx);
+/*
+ * Micro-benchmark of the Swarm class, on a synthetic swarm much larger than
+ * the ones of the tests: every member joins, then is promoted to seed, and
+ * the delta of the last changes and the whole swarm are packed repeatedly.
+ */
+void Tracker::benchmark_swarm() {
+    int cnt = SWARM_BENCH_MEMBERS;
+    Swarm swarm;
+
+    double start = MPI_Wtime();
+    for (int rank = 0; rank < cnt; rank++) {
+        swarm.add_peer(rank);
+    }
+    double join_time = MPI_Wtime() - start;
+
+    start = MPI_Wtime();
+    for (int rank = 0; rank < cnt; rank++) {
+        swarm.add_seed(rank);
     }
+    double promote_time = MPI_Wtime() - start;
 
-    // Send ACK to all clients.
-    for (int client_idx = 1; client_idx < numtasks; client_idx++) {
-        int msg = ACK;
-        MPI_Send(&msg, 1, MPI_INT, client_idx, INIT_TAG, MPI_COMM_WORLD);
+    vector<SwarmChange> changes;
+    start = MPI_Wtime();
+    for (int i = 0; i < cnt; i++) {
+        swarm.changes_since(swarm.version - SWARM_LOG_SIZE, changes);
     }
+    double delta_time = MPI_Wtime() - start;
+
+    int snapshots = SWARM_BENCH_SNAPSHOTS;
+    start = MPI_Wtime();
+    for (int i = 0; i < snapshots; i++) {
+        Message reply(SWARM_FULL, 0, 0, swarm.version);
+        reply.append_int_vector(swarm.members);
+    }
+    double snapshot_time = MPI_Wtime() - start;
+
+    cerr << "[tracker " << this->rank << "] swarm of " << swarm.get_size() << " members: "
+         << cnt / join_time << " joins/s, " << cnt / promote_time << " promotions/s, "
+         << cnt / delta_time << " deltas/s, " << snapshots / snapshot_time << " snapshots/s\n";
 }
 
 
-void Tracker::recv_file_details_from_client(int client_idx) {
-    // Receive the files count.
-    int files_cnt;
-    MPI_Recv(&files_cnt, 1, MPI_INT, client_idx, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/*
+ * Gathers, from each client, the number of segments it served, the number it
+ * downloaded and how long its downloads took, once all of them stopped. The
+ * first tracker prints how evenly the segments were served, the throughput of
+ * the whole swarm and how fairly it was shared among the downloaders.
+ */
+void Tracker::report_load_balance() {
+    double own_report[3] = {0, 0, 0};
+
+    if (this->rank != TRACKER_RANK) {
+        MPI_Gather(own_report, 3, MPI_DOUBLE, NULL, 0, MPI_DOUBLE, TRACKER_RANK, MPI_COMM_WORLD);
+        return;
+    }
+
+    vector<double> reports(3 * this->numtasks);
+    MPI_Gather(own_report, 3, MPI_DOUBLE, reports.data(), 3, MPI_DOUBLE, TRACKER_RANK, MPI_COMM_WORLD);
+
+    int clients = this->numtasks - this->trackers;
+    vector<double> loads;
+    vector<double> download_rates;
+    double downloaded = 0;
+    double swarm_time = 0;
+
+    for (int client_idx = this->trackers; client_idx < this->numtasks; client_idx++) {
+        double *report = &reports[3 * client_idx];
+        loads.push_back(report[0]);
+
+        if (report[1] > 0) {
+            download_rates.push_back(report[1] / max(report[2], 1e-9));
+            downloaded += report[1];
+            swarm_time = max(swarm_time, report[2]);
+        }
+    }
+
+    double mean = 0;
+    for (double load : loads) {
+        mean += load;
+    }
+    mean /= clients;
+
+    double variance = 0;
+    for (double load : loads) {
+        variance += (load - mean) * (load - mean);
+    }
+    variance /= clients;
+
+    auto [min_load, max_load] = minmax_element(loads.begin(), loads.end());
+
+    cerr << "[tracker] segments served per client: mean " << mean << ", variance " << variance
+         << ", min " << *min_load << ", max " << *max_load << ", Jain's fairness index "
+         << jain_index(loads) << "\n";
+    cerr << "[tracker] swarm: " << downloaded << " segments downloaded in " << swarm_time << " s ("
+         << downloaded / max(swarm_time, 1e-9) << " segments/s), Jain's fairness index of the "
+         << download_rates.size() << " download rates " << jain_index(download_rates) << "\n";
+}
+
+
+void Tracker::handle_request(int client_idx, Message &request, int &finished_clients) {
+    switch (request.header.type) {
+        case FILE_DETAILS_REQ:
+            handle_file_details_request(client_idx, request.file_name, request.header.value);
+            break;
+
+        case UPDATE_SWARM_REQ:
+            handle_update_swarm_request(client_idx, request.header.file, request.header.value);
+            break;
+
+        case FILE_DOWNLOAD_COMPLETE:
+            handle_file_download_complete_from_client(client_idx, request.header.file);
+            break;
+
+        case SEGMENTS_REPORT:
+            handle_segments_report(client_idx, request);
+            break;
+
+        case WHO_HAS:
+            handle_who_has_request(client_idx, request);
+            break;
+
+        case ALL_FILES_RECEIVED:
+            finished_clients++;
+            break;
+
+        case LARGE_REQUEST:
+            handle_large_request(client_idx, finished_clients);
+            break;
+    }
+}
+
+
+/*
+ * A request too large for the posted receives follows its LARGE_REQUEST on
+ * TRACKER_LARGE_TAG. It was sent right after, so it is received at once, with
+ * a buffer sized by a matched probe, and handled in its place.
+ */
+void Tracker::handle_large_request(int client_idx, int &finished_clients) {
+    Message request;
+    request.recv(client_idx, TRACKER_LARGE_TAG);
+
+    handle_request(client_idx, request, finished_clients);
+}
+
+
+void Tracker::post_request_recv(int client_idx) {
+    MPI_Irecv(this->recv_buffers[client_idx].data(), TRACKER_REQ_SIZE, MPI_BYTE, client_idx,
+              TRACKER_TAG, MPI_COMM_WORLD, &this->recv_requests[client_idx]);
+}
+
+
+/*
+ * Sends a reply without waiting for the client to receive it. The buffer is
+ * kept until the send completes.
+ */
+void Tracker::reply(const Message &msg, int dest, int tag) {
+    this->reply_buffers.emplace_back();
+    this->reply_requests.emplace_back();
+
+    msg.isend(dest, tag, this->reply_buffers.back(), &this->reply_requests.back());
+    this->sent_bytes += this->reply_buffers.back().size();
+}
+
+
+void Tracker::progress_replies() {
+    progress_sends(this->reply_requests, this->reply_buffers);
+}
+
+
+void Tracker::shutdown() {
+    // No client sends anything after ALL_FILES_RECEIVED, so the posted
+    // receives can be cancelled.
+    for (int client_idx = this->trackers; client_idx < this->numtasks; client_idx++) {
+        MPI_Cancel(&this->recv_requests[client_idx]);
+        MPI_Wait(&this->recv_requests[client_idx], MPI_STATUS_IGNORE);
+    }
+
+    MPI_Waitall(this->reply_requests.size(), this->reply_requests.data(), MPI_STATUSES_IGNORE);
+    this->reply_requests.clear();
+    this->reply_buffers.clear();
+}
+
+
+void Tracker::initialize() {
+    // Each tracker is, in turn, the root of a gather of the manifests of its
+    // partition: the sizes first, then all the manifests, in two collectives.
+    for (int root = 0; root < this->trackers; root++) {
+        if (root != this->rank) {
+            int own_size = 0;
+            MPI_Gather(&own_size, 1, MPI_INT, NULL, 0, MPI_INT, root, MPI_COMM_WORLD);
+            MPI_Gatherv(NULL, 0, MPI_BYTE, NULL, NULL, NULL, MPI_BYTE, root, MPI_COMM_WORLD);
+            MPI_Scatterv(NULL, NULL, NULL, MPI_INT, NULL, 0, MPI_INT, root, MPI_COMM_WORLD);
+            continue;
+        }
+
+        int own_size = 0;
+        vector<int> sizes(this->numtasks);
+        MPI_Gather(&own_size, 1, MPI_INT, sizes.data(), 1, MPI_INT, root, MPI_COMM_WORLD);
+
+        vector<int> displs(this->numtasks, 0);
+        for (int i = 1; i < this->numtasks; i++) {
+            displs[i] = displs[i - 1] + sizes[i - 1];
+        }
+
+        vector<char> manifests(displs[this->numtasks - 1] + sizes[this->numtasks - 1]);
+        MPI_Gatherv(NULL, 0, MPI_BYTE, manifests.data(), sizes.data(), displs.data(), MPI_BYTE,
+                    root, MPI_COMM_WORLD);
+
+        // The ID of each file of each manifest, in the order of the manifest,
+        // after the number of files of this tracker (the clients size their
+        // tables of files with it).
+        vector<vector<int>> ids(this->numtasks);
+        for (int client_idx = this->trackers; client_idx < numtasks; client_idx++) {
+            Message manifest;
+            manifest.payload.assign(manifests.begin() + displs[client_idx],
+                                    manifests.begin() + displs[client_idx] + sizes[client_idx]);
+
+            ids[client_idx].push_back(0);
+            parse_manifest_from_client(client_idx, manifest, ids[client_idx]);
+        }
+
+        vector<int> counts(this->numtasks, 0);
+        vector<int> ids_displs(this->numtasks, 0);
+        vector<int> all_ids;
+        for (int client_idx = this->trackers; client_idx < numtasks; client_idx++) {
+            ids[client_idx][0] = this->file_names.size();
+
+            counts[client_idx] = ids[client_idx].size();
+            ids_displs[client_idx] = all_ids.size();
+            all_ids.insert(all_ids.end(), ids[client_idx].begin(), ids[client_idx].end());
+        }
+
+        MPI_Scatterv(all_ids.data(), counts.data(), ids_displs.data(), MPI_INT, NULL, 0, MPI_INT,
+                     root, MPI_COMM_WORLD);
+    }
+
+    // Signal all clients to start.
+    int msg = ACK;
+    MPI_Bcast(&msg, 1, MPI_INT, TRACKER_RANK, MPI_COMM_WORLD);
+}
+
+
+/*
+ * Reads the files of a manifest, appending the ID of each one to ids.
+ */
+void Tracker::parse_manifest_from_client(int client_idx, Message &manifest, std::vector<int> &ids) {
+    int files_cnt = manifest.read_int();
 
     for (int i = 0; i < files_cnt; i++) {
-        // Receive file name (including '\0').
-        char buff[MAX_FILENAME + 1];
-        MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, client_idx, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-        string file_name(buff);
+        string file_name = manifest.read_string();
 
-        // If the file is already in the database, don't store its segment details again.
-        bool already_stored = this->file_database.find(file_name) != this->file_database.end();
+        SegmentTable segments;
+        manifest.read_segment_table(segments);
+
+        int file = intern_file(file_name, segments);
+        ids.push_back(file);
 
         // Save the client as a seed for this file.
-        this->file_to_swarm[file_name].add_seed(client_idx);
+        this->file_to_swarm[local_index(file)].add_seed(client_idx);
+
+        // As a seed, the client owns every segment of the file.
+        if (this->replica_index) {
+            replicas_of(file).add_all(client_idx);
+        }
+    }
+}
+
 
-        // Receive segments count.
-        int segments_cnt;
-        MPI_Recv(&segments_cnt, 1, MPI_INT, client_idx, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+/*
+ * The ID of a file, given the next number of the partition the first time the
+ * file is seen. Only the first segment table of a file is stored.
+ */
+int Tracker::intern_file(const std::string &file_name, SegmentTable &segments) {
+    auto it = this->file_ids.find(file_name);
+    if (it != this->file_ids.end()) {
+        return it->second;
+    }
+
+    int file = this->file_names.size() * this->trackers + this->rank;
+    this->file_ids[file_name] = file;
+    this->file_names.push_back(file_name);
+
+    this->file_to_swarm.emplace_back();
+    this->file_replicas.push_back(this->replica_index ? ReplicaIndex(segments.size(), this->numtasks)
+                                                      : ReplicaIndex());
+    this->file_database.push_back(move(segments));
+
+    return file;
+}
 
-        for (int j = 0; j < segments_cnt; j++) {
-            // Receive segment hash (add '\0' manually).
-            char hash_buff[HASH_SIZE + 1];
-            MPI_Recv(hash_buff, HASH_SIZE, MPI_CHAR, client_idx, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            hash_buff[HASH_SIZE] = '\0';
 
-            // Receive segment index.
-            int index;
-            MPI_Recv(&index, 1, MPI_INT, client_idx, INIT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+int Tracker::local_index(int file) const {
+    return file / this->trackers;
+}
+
+
+/*
+ * The replica index of a file: one bit per rank for each segment.
+ */
+ReplicaIndex &Tracker::replicas_of(int file) {
+    return this->file_replicas[local_index(file)];
+}
 
-            if (!already_stored) {
-                string hash(hash_buff);
 
-                file_database[file_name].emplace_back(hash, index);
-            }
+/*
+ * A batch of segments received by a client, as (first index, count) ranges.
+ */
+void Tracker::handle_segments_report(int client_idx, Message &request) {
+    ReplicaIndex &replicas = replicas_of(request.header.file);
+
+    int ranges_cnt = request.read_int();
+    for (int i = 0; i < ranges_cnt; i++) {
+        int first = request.read_int();
+        int cnt = request.read_int();
+
+        for (int idx = first; idx < first + cnt; idx++) {
+            replicas.add(client_idx, idx);
         }
     }
 }
 
 
-void Tracker::handle_file_details_request(int client_idx) {
-    // Receive file name (including '\0').
-    char buff[MAX_FILENAME + 1];
-    MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, client_idx, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    string file_name(buff);
+/*
+ * Replies with some owners of each of the asked segments, in a single message:
+ * the segments count, then, for each segment, its index and its owners.
+ */
+void Tracker::handle_who_has_request(int client_idx, Message &request) {
+    ReplicaIndex &replicas = replicas_of(request.header.file);
+
+    vector<int> indices;
+    request.read_int_vector(indices);
+
+    Message reply(WHO_HAS_REPLY, request.header.file, 0, 0);
+    reply.append_int(indices.size());
 
-    send_file_swarm_to_client(file_name, client_idx);
-    send_file_segment_details_to_client(file_name, client_idx);
+    // Start the scan after the requester, so requesters get different owners,
+    // and further for a repeated query, so it gets different owners too.
+    int start = (client_idx + 1 + request.header.value) % this->numtasks;
 
-    // Set the client as a peer for the file.
-    this->file_to_swarm[file_name].add_peer(client_idx);
+    vector<int> owners;
+    for (int idx : indices) {
+        replicas.owners_of(idx, start, WHO_HAS_MAX_OWNERS, owners);
+        owners.erase(remove(owners.begin(), owners.end(), client_idx), owners.end());
+
+        reply.append_int(idx);
+        reply.append_int_vector(owners);
+    }
+
+    this->reply(reply, client_idx, DOWNLOAD_TAG);
 }
 
 
-void Tracker::send_file_swarm_to_client(const std::string &file_name, int client_idx) {
-    // Send the swarm size.
-    int swarm_size = this->file_to_swarm[file_name].get_size();
-    MPI_Send(&swarm_size, 1, MPI_INT, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+void Tracker::handle_file_details_request(int client_idx, const std::string &file_name, bool pex) {
+    // Every file of the network has a seed at the start, so a file the
+    // tracker has never heard of cannot be downloaded.
+    auto it = this->file_ids.find(file_name);
+    if (it == this->file_ids.end()) {
+        this->reply(Message(NACK, file_name), client_idx, DOWNLOAD_TAG);
+        return;
+    }
+    int file = it->second;
 
-    // Send the swarm.
-    for (int seed : this->file_to_swarm[file_name].seeds) {
-        MPI_Send(&seed, 1, MPI_INT, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    // Set the client as a peer for the file, and tell the other downloaders.
+    // A repeated query does not change the swarm.
+    Swarm &swarm = this->file_to_swarm[local_index(file)];
+    if (swarm.add_peer(client_idx)) {
+        notify_swarm_changed(file, client_idx);
     }
 
-    for (int peer : this->file_to_swarm[file_name].peers) {
-        MPI_Send(&peer, 1, MPI_INT, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    // A client that learns the new members from its peers (peer exchange) is
+    // never notified: it counts as already told.
+    if (pex) {
+        swarm.notified.insert(client_idx);
     }
+
+    // Send the ID of the file, its swarm (with its version) and its segment
+    // details in a single reply. From now on, the client names it by its ID.
+    Message reply(ACK, file, 0, swarm.version);
+    pack_file_swarm(file, reply);
+    pack_file_segment_details(file, reply);
+    this->reply(reply, client_idx, DOWNLOAD_TAG);
+}
+
+
+void Tracker::pack_file_swarm(int file, Message &reply) {
+    Swarm &swarm = this->file_to_swarm[local_index(file)];
+
+    // Pack the swarm as a size, followed by the members.
+    reply.append_int_vector(swarm.members);
+}
+
+
+void Tracker::pack_file_segment_details(int file, Message &reply) {
+    reply.append_segment_table(this->file_database[local_index(file)]);
 }
 
 
-void Tracker::send_file_segment_details_to_client(const std::string &file_name, int client_idx) {
-    // Send the number of segments.
-    int segment_cnt = file_database[file_name].size();
-    MPI_Send(&segment_cnt, 1, MPI_INT, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+void Tracker::handle_update_swarm_request(int client_idx, int file, int known_version) {
+    Swarm &swarm = this->file_to_swarm[local_index(file)];
+    swarm.notified.erase(client_idx);
 
-    for (const auto &segment : file_database[file_name]) {
-        // Send segment hash.
-        MPI_Send(segment.hash.c_str(), HASH_SIZE, MPI_CHAR, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    // Only send what changed since the version the client knows, if possible.
+    vector<SwarmChange> changes;
+    if (!swarm.changes_since(known_version, changes)) {
+        Message reply(SWARM_FULL, file, 0, swarm.version);
+        pack_file_swarm(file, reply);
+        this->reply(reply, client_idx, DOWNLOAD_TAG);
+        return;
+    }
+
+    if (changes.empty()) {
+        this->reply(Message(SWARM_UNCHANGED, file, 0, swarm.version), client_idx, DOWNLOAD_TAG);
+        return;
+    }
 
-        // Send segment index.
-        MPI_Send(&segment.index, 1, MPI_INT, client_idx, DOWNLOAD_TAG, MPI_COMM_WORLD);
+    Message reply(SWARM_DELTA, file, 0, swarm.version);
+    reply.append_int(changes.size());
+    for (const SwarmChange &change : changes) {
+        reply.append_int(change.rank);
+        reply.append_int(change.seed);
     }
+    this->reply(reply, client_idx, DOWNLOAD_TAG);
 }
 
 
-void Tracker::handle_update_swarm_request(int client_idx) {
-    // Receive file name (including '\0').
-    char buff[MAX_FILENAME + 1];
-    MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, client_idx, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    string file_name(buff);
+/*
+ * Tells the downloaders of a file (except the one that caused the change)
+ * that its swarm has a new member. A downloader is told only once until it
+ * asks for the changes.
+ */
+void Tracker::notify_swarm_changed(int file, int except) {
+    Swarm &swarm = this->file_to_swarm[local_index(file)];
+
+    for (int peer : swarm.members) {
+        if (swarm.role_of(peer) != SwarmRole::PEER || peer == except || swarm.notified.count(peer)) {
+            continue;
+        }
 
-    send_file_swarm_to_client(file_name, client_idx);
+        swarm.notified.insert(peer);
+        reply(Message(SWARM_CHANGED, file, 0, swarm.version), peer, DOWNLOAD_TAG);
+    }
 }
 
 
-void Tracker::handle_file_download_complete_from_client(int client_idx) {
-    // Receive file name (including '\0').
-    char buff[MAX_FILENAME + 1];
-    MPI_Recv(buff, MAX_FILENAME + 1, MPI_CHAR, client_idx, TRACKER_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    string file_name(buff);
+void Tracker::handle_file_download_complete_from_client(int client_idx, int file) {
+    // Mark the client as a seed for the file. The downloaders are not told:
+    // the new seed is already a member, and its HAVEs reached them already.
+    Swarm &swarm = this->file_to_swarm[local_index(file)];
+    swarm.add_seed(client_idx);
+    swarm.notified.erase(client_idx);
 
-    // Mark the client as a seed for the file.
-    this->file_to_swarm[file_name].mark_peer_as_seed(client_idx);
+    if (this->replica_index) {
+        replicas_of(file).add_all(client_idx);
+    }
 }
 
 
 void Tracker::announce_all_clients_to_stop() {
-    for (int client_idx = 1; client_idx < this->numtasks; client_idx++) {
-        int msg = STOP;
-        MPI_Send(&msg, 1, MPI_INT, client_idx, UPLOAD_TAG, MPI_COMM_WORLD);
+    // Every tracker stops the download threads, so none of them stops before
+    // receiving all the notifications of all the trackers. The upload thread
+    // of each client is stopped by a single tracker, its home tracker.
+    for (int client_idx = this->trackers; client_idx < this->numtasks; client_idx++) {
+        Message msg(STOP);
+        reply(msg, client_idx, DOWNLOAD_TAG);
+
+        if (client_idx % this->trackers == this->rank) {
+            reply(msg, client_idx, UPLOAD_TAG);
+        }
     }
 }
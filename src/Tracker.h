@@ -4,37 +4,94 @@
 #include <unordered_map>
 #include <vector>
 #include <string>
+#include <mpi.h>
 #include "helper_objects.h"
+#include "Message.h"
 
 
+/*
+ * One of the trackers (ranks 0 .. trackers - 1). It only knows the files of
+ * its own partition (see tracker_of), but serves every client.
+ */
 class Tracker {
     int numtasks;
     int rank;
+    int trackers;
 
-    // file -> (seeds, peers)
-    std::unordered_map<std::string, Swarm> file_to_swarm;
+    // The files of the partition, numbered at bootstrap in the order they
+    // are first seen. The state of a file is at its local number
+    // (ID / trackers); the names are only looked up for a FILE_DETAILS_REQ.
+    std::unordered_map<std::string, int> file_ids;
+    std::vector<std::string> file_names;
 
-    std::unordered_map<std::string, std::vector<Segment>> file_database;
+    // The swarm of each file (its members and their roles), by local number.
+    std::vector<Swarm> file_to_swarm;
+
+    std::vector<SegmentTable> file_database;
+
+    // file -> owners of each segment (only with the replica index on).
+    bool replica_index;
+    std::vector<ReplicaIndex> file_replicas;
+
+    // One receive is always posted for each client (index = rank), into its
+    // own buffer.
+    std::vector<MPI_Request> recv_requests;
+    std::vector<std::vector<char>> recv_buffers;
+
+    // Replies still in flight, with their buffers.
+    std::vector<MPI_Request> reply_requests;
+    std::vector<std::vector<char>> reply_buffers;
+
+    bool print_stats;
+    long sent_bytes;
 
  public:
-    Tracker(int numtasks, int rank);
+    Tracker(int numtasks, int rank, int trackers);
 
     void run();
 
  private:
     void initialize();
 
-    void recv_file_details_from_client(int client_idx);
+    void parse_manifest_from_client(int client_idx, Message &manifest, std::vector<int> &ids);
+
+    int intern_file(const std::string &file_name, SegmentTable &segments);
+
+    int local_index(int file) const;
+
+    void handle_large_request(int client_idx, int &finished_clients);
+
+    void post_request_recv(int client_idx);
+
+    void handle_request(int client_idx, Message &request, int &finished_clients);
+
+    void reply(const Message &msg, int dest, int tag);
+
+    void progress_replies();
+
+    void shutdown();
+
+    void report_load_balance();
+
+    void benchmark_swarm();
+
+    void handle_file_details_request(int client_idx, const std::string &file_name, bool pex);
+
+    void pack_file_swarm(int file, Message &reply);
+
+    void pack_file_segment_details(int file, Message &reply);
+
+    void handle_update_swarm_request(int client_idx, int file, int known_version);
 
-    void handle_file_details_request(int client_idx);
+    void notify_swarm_changed(int file, int except);
 
-    void send_file_swarm_to_client(const std::string &file_name, int client_idx);
+    ReplicaIndex &replicas_of(int file);
 
-    void send_file_segment_details_to_client(const std::string &file_name, int client_idx);
+    void handle_segments_report(int client_idx, Message &request);
 
-    void handle_update_swarm_request(int client_idx);
+    void handle_who_has_request(int client_idx, Message &request);
 
-    void handle_file_download_complete_from_client(int client_idx);
+    void handle_file_download_complete_from_client(int client_idx, int file);
 
     void announce_all_clients_to_stop();
 };
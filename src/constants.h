@@ -1,38 +1,190 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+// The first tracker, root of the bootstrap collectives.
 #define TRACKER_RANK 0
-#define MAX_FILES 10
-#define MAX_FILENAME 15
 #define HASH_SIZE 32
-#define MAX_CHUNKS 100
+#define DIGEST_SIZE 16
 
 /*
  * Rule: For an MPI message, the tag is:
- *      -INIT_TAG -> for messages from the initialization stage
  *      -TRACKER_TAG -> for messages that have the tracker as destination
  *      -DOWNLOAD_TAG -> for messages that have a download thread of a client as destination
  *      -UPLOAD_TAG -> for messages that have an upload thread of a client as destination
+ *      -TRACKER_LARGE_TAG -> for a request to the tracker too large for its
+ *       posted receives, announced by a LARGE_REQUEST on TRACKER_TAG
  * 
+ *      -REPLY_TAG_BASE + slot -> for the reply to the GET_SEGMENTS sent from
+ *       request slot "slot" of a download thread
+ *      -DATA_TAG_BASE + slot -> for the segment bytes of that reply (payload mode)
+ *
  * Thus, there will be no risk of miscommunication if two threads execute
- * a Recv at the same time.
+ * a Recv at the same time, and each reply to a segment request lands
+ * directly in the receive posted for it.
+ *
+ * The initialization stage uses collectives (MPI_Gather, MPI_Gatherv, MPI_Bcast),
+ * issued before any client thread is started.
  */
 
-#define INIT_TAG 1
 #define TRACKER_TAG 2
 #define DOWNLOAD_TAG 3
 #define UPLOAD_TAG 4
+#define TRACKER_LARGE_TAG 5
+#define REPLY_TAG_BASE 100
+#define DATA_TAG_BASE 10100
+
+// Largest number of request slots: more would make the reply tags overlap the
+// data tags. The highest tag (DATA_TAG_BASE + MAX_GLOBAL_WINDOW - 1) stays
+// below 32767, the smallest MPI_TAG_UB the MPI standard allows.
+#define MAX_GLOBAL_WINDOW (DATA_TAG_BASE - REPLY_TAG_BASE)
+
+// Size of the buffer of each receive posted by the tracker (bytes). A request to
+// the tracker usually carries a header, a file name and a few indices; a larger
+// one (a long file name) is announced by a LARGE_REQUEST and received on its own.
+#define TRACKER_REQ_SIZE 256
+
+// Upper bound of the size of a reply to a GET_SEGMENTS (bytes).
+#define MAX_REPLY_SIZE 64
+
+// Default number of segment requests in flight, overall and per peer.
+// They can be overridden by the BT_GLOBAL_WINDOW (at most MAX_GLOBAL_WINDOW)
+// and BT_PEER_WINDOW variables.
+#define GLOBAL_WINDOW 16
+#define PEER_WINDOW 4
+
+// Number of segments of each file requested in random order, before switching
+// to rarest first.
+#define RANDOM_FIRST_SEGMENTS 4
+
+// Default number of in-flight segments left in a file below which the remaining
+// ones are also requested from other owners (BT_ENDGAME_THRESHOLD variable),
+// and the maximum number of copies of such a request.
+#define ENDGAME_THRESHOLD 4
+#define ENDGAME_COPIES 2
+
+// Deadline of a segment request: TIMEOUT_FACTOR times the average latency of the
+// peer, but at least REQUEST_TIMEOUT (seconds). LATENCY_WEIGHT is the weight of a
+// new sample in that average.
+#define REQUEST_TIMEOUT 0.2
+#define TIMEOUT_FACTOR 8
+#define LATENCY_WEIGHT 0.2
+
+// Number of swarm changes the tracker remembers for each file. A client that
+// is further behind gets the whole swarm again.
+#define SWARM_LOG_SIZE 64
+
+// Size of the synthetic swarm of the Swarm micro-benchmark (BT_STATS), and
+// the number of times it is packed whole.
+#define SWARM_BENCH_MEMBERS 16384
+#define SWARM_BENCH_SNAPSHOTS 256
+
+// Peer exchange (on by default, BT_PEX=0 turns it off): at most
+// PEX_MAX_MEMBERS swarm members are sent in a message.
+#define PEX 1
+#define PEX_MAX_MEMBERS 64
+
+// Replica index (off by default, BT_REPLICA_INDEX=1 turns it on): the clients
+// report their segments to the tracker in batches of REPORT_BATCH, and ask it
+// for the owners of up to WHO_HAS_BATCH segments at once, getting at most
+// WHO_HAS_MAX_OWNERS owners for each. The segments with known owners are
+// asked again every WHO_HAS_INTERVAL seconds, to learn their newer replicas.
+#define REPLICA_INDEX 0
+#define REPORT_BATCH 16
+#define WHO_HAS_BATCH 32
+#define WHO_HAS_MAX_OWNERS 4
+#define WHO_HAS_INTERVAL 0.05
+
+// Default number of trackers (ranks 0 .. TRACKERS - 1), each owning a
+// partition of the file names.
+#define TRACKERS 1
+
+// Age (seconds) after which the load of a peer, piggybacked on its replies,
+// is not trusted anymore.
+#define LOAD_MAX_AGE 1.0
+
+// Default maximum number of consecutive segments asked in one GET_SEGMENTS
+// (BT_SEGMENT_BATCH variable).
+#define SEGMENT_BATCH 4
+
+// Payload mode (off by default, BT_PAYLOAD=1 turns it on): the segments are
+// actually sent, from and into memory-mapped files. SEGMENT_SIZE (bytes) is
+// the default size of a segment (BT_SEGMENT_SIZE variable).
+#define PAYLOAD 0
+#define SEGMENT_SIZE 65536
+
+// Verification of the received segments against their MD5 in payload mode
+// (off by default, BT_VERIFY=1 turns it on), by a pool of VERIFIERS threads
+// (BT_VERIFIERS variable).
+#define VERIFY 0
+#define VERIFIERS 1
+
+// Choke scheduler (off by default, BT_CHOKE=1 turns it on): each client serves
+// at most UNCHOKE_SLOTS interested peers at a time (BT_UNCHOKE_SLOTS variable).
+// Every CHOKE_INTERVAL seconds, all but one of the slots go to the peers that
+// uploaded the most to it (or, failing that, downloaded the most from it)
+// during the interval, and the last one is an optimistic unchoke, moved to the
+// next choked peer every OPTIMISTIC_ROUNDS intervals.
+#define CHOKE_SCHEDULER 0
+#define UNCHOKE_SLOTS 4
+#define CHOKE_INTERVAL 0.1
+#define OPTIMISTIC_ROUNDS 3
+
+// Upload rate limit towards each peer, in segments per second (BT_UPLOAD_RATE
+// variable, 0 for none), with bursts of up to UPLOAD_BURST segments
+// (BT_UPLOAD_BURST variable).
+#define UPLOAD_RATE 0
+#define UPLOAD_BURST 8
+
+// Default number of threads serving upload requests (BT_UPLOAD_WORKERS variable).
+#define UPLOAD_WORKERS 2
+
+// Default number of wanted files downloaded at the same time (BT_SESSIONS variable).
+#define MAX_SESSIONS 4
 
 #define ACK 42
 #define NACK -42
 
 #define FILE_DETAILS_REQ 10
 #define UPDATE_SWARM_REQ 11
-#define HAS_SEGMENT_REQ 12
-#define GET_SEGMENT_REQ 13
+#define BITFIELD_REQ 12
+#define GET_SEGMENTS 13
 #define FILE_DOWNLOAD_COMPLETE 14
 #define ALL_FILES_RECEIVED 15
 #define STOP 16
+#define HAVE 17
+#define NOT_INTERESTED 18
+#define CANCEL 19
+#define BITFIELD 20
+#define SWARM_CHANGED 21
+#define SWARM_FULL 22
+#define SWARM_DELTA 23
+#define SWARM_UNCHANGED 24
+#define PEX_MEMBERS 25
+#define SEGMENTS_REPORT 26
+#define WHO_HAS 27
+#define WHO_HAS_REPLY 28
+#define LARGE_REQUEST 29
+#define CHOKE 30
+#define UNCHOKE 31
+
+/*
+ * Messages that expect no reply (HAVE, NOT_INTERESTED, CANCEL) are notifications. They are
+ * sent with MPI_Issend and the download thread completes all of them before
+ * sending ALL_FILES_RECEIVED, so none can be left unreceived at the end.
+ *
+ * BITFIELD_REQ is sent the same way. Its BITFIELD reply comes from an upload
+ * worker of the peer, whenever it is served: the download thread counts the
+ * replies it still expects and receives all of them before sending
+ * ALL_FILES_RECEIVED (the peer cannot stop before that).
+ *
+ * CHOKE and UNCHOKE come from the upload thread of a peer. Before sending
+ * ALL_FILES_RECEIVED, the download thread sends a NOT_INTERESTED for no file
+ * (-1) to every peer it asked for something, and waits for the last CHOKE of
+ * each (value 1), after which that peer never writes to it again.
+ */
+
+// Idle time of a polling loop with nothing to do (microseconds).
+#define POLL_INTERVAL_US 50
 
 
 #endif /* CONSTANTS_H */
@@ -1,38 +1,518 @@
 #include "helper_objects.h"
 #include <algorithm>
+#include <array>
 
 
-Segment::Segment(std::string hash, int index) {
-    this->hash = hash;
-    this->index = index;
+// Value of each hex digit, indexed by character, -1 for the other characters.
+static const std::array<int8_t, 256> HEX_VALUES = [] {
+    std::array<int8_t, 256> values;
+    values.fill(-1);
+
+    for (int c = 0; c < 10; c++) {
+        values['0' + c] = c;
+    }
+
+    for (int c = 0; c < 6; c++) {
+        values['a' + c] = 10 + c;
+        values['A' + c] = 10 + c;
+    }
+
+    return values;
+}();
+
+
+bool hex_to_digest(const char *hex, size_t len, Digest &digest) {
+    if (len != HASH_SIZE) {
+        return false;
+    }
+
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        int high = HEX_VALUES[(unsigned char) hex[2 * i]];
+        int low = HEX_VALUES[(unsigned char) hex[2 * i + 1]];
+
+        if (high < 0 || low < 0) {
+            return false;
+        }
+
+        digest.bytes[i] = (high << 4) | low;
+    }
+
+    return true;
+}
+
+
+std::string digest_to_hex(const Digest &digest) {
+    static const char hex_digits[] = "0123456789abcdef";
+
+    std::string hex(HASH_SIZE, '0');
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        hex[2 * i] = hex_digits[digest.bytes[i] >> 4];
+        hex[2 * i + 1] = hex_digits[digest.bytes[i] & 0xf];
+    }
+
+    return hex;
+}
+
+
+int tracker_of(const std::string &file, int trackers) {
+    // 32-bit FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : file) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+
+    return hash % trackers;
+}
+
+
+int tracker_of(int file, int trackers) {
+    return file % trackers;
+}
+
+
+void SegmentTable::add(int index, const Digest &digest) {
+    this->indices.push_back(index);
+    this->digests.push_back(digest);
+}
+
+
+void SegmentTable::reserve(int cnt) {
+    this->indices.reserve(cnt);
+    this->digests.reserve(cnt);
+}
+
+
+int SegmentTable::size() const {
+    return this->indices.size();
+}
+
+
+Bitfield::Bitfield(int size) : size(size), words((size + 63) / 64) {
+    for (auto &word : this->words) {
+        word.store(0, std::memory_order_relaxed);
+    }
+}
+
+
+void Bitfield::set(int idx) {
+    this->words[idx / 64].fetch_or(1ULL << (idx % 64), std::memory_order_release);
+}
+
+
+void Bitfield::set_all() {
+    for (int idx = 0; idx < this->size; idx++) {
+        set(idx);
+    }
+}
+
+
+bool Bitfield::test(int idx) const {
+    if (idx < 0 || idx >= this->size) {
+        return false;
+    }
+
+    return this->words[idx / 64].load(std::memory_order_acquire) & (1ULL << (idx % 64));
+}
+
+
+int Bitfield::get_size() const {
+    return this->size;
+}
+
+
+void Bitfield::snapshot(std::vector<uint64_t> &words) const {
+    words.resize(this->words.size());
+
+    for (size_t i = 0; i < words.size(); i++) {
+        words[i] = this->words[i].load(std::memory_order_acquire);
+    }
+}
+
+
+PendingSegments::PendingSegments(int segment_cnt) {
+    this->counts.assign(segment_cnt, -1);
+    this->member_positions.assign(segment_cnt, -1);
+    this->bucket_positions.assign(segment_cnt, -1);
+}
+
+
+void PendingSegments::add(int idx, int count) {
+    if (this->counts[idx] != -1) {
+        return;
+    }
+
+    if (count >= (int) this->buckets.size()) {
+        this->buckets.resize(count + 1);
+    }
+
+    this->counts[idx] = count;
+    this->member_positions[idx] = this->members.size();
+    this->members.push_back(idx);
+    this->bucket_positions[idx] = this->buckets[count].size();
+    this->buckets[count].push_back(idx);
+}
+
+
+void PendingSegments::unlink(int idx) {
+    std::vector<int> &bucket = this->buckets[this->counts[idx]];
+    int last = bucket.back();
+    bucket[this->bucket_positions[idx]] = last;
+    this->bucket_positions[last] = this->bucket_positions[idx];
+    bucket.pop_back();
+}
+
+
+void PendingSegments::remove(int idx) {
+    if (this->counts[idx] == -1) {
+        return;
+    }
+
+    unlink(idx);
+
+    int last = this->members.back();
+    this->members[this->member_positions[idx]] = last;
+    this->member_positions[last] = this->member_positions[idx];
+    this->members.pop_back();
+
+    this->counts[idx] = -1;
+}
+
+
+void PendingSegments::update(int idx, int count) {
+    if (this->counts[idx] == -1 || this->counts[idx] == count) {
+        return;
+    }
+
+    unlink(idx);
+
+    if (count >= (int) this->buckets.size()) {
+        this->buckets.resize(count + 1);
+    }
+
+    this->counts[idx] = count;
+    this->bucket_positions[idx] = this->buckets[count].size();
+    this->buckets[count].push_back(idx);
+}
+
+
+bool PendingSegments::contains(int idx) const {
+    return idx >= 0 && idx < (int) this->counts.size() && this->counts[idx] != -1;
+}
+
+
+bool PendingSegments::empty() const {
+    return this->members.empty();
+}
+
+
+int PendingSegments::size() const {
+    return this->members.size();
+}
+
+
+int PendingSegments::at(int k) const {
+    return this->members[k];
+}
+
+
+int PendingSegments::max_count() const {
+    return (int) this->buckets.size() - 1;
+}
+
+
+const std::vector<int> &PendingSegments::with_count(int count) const {
+    static const std::vector<int> none;
+
+    return count < (int) this->buckets.size() ? this->buckets[count] : none;
 }
 
 
-void Swarm::add_seed(int seed) {
-    this->seeds.push_back(seed);
+Availability::Availability(int segment_cnt) {
+    this->segment_cnt = segment_cnt;
+    this->counts.assign(segment_cnt, 0);
+    this->pending = NULL;
 }
 
 
-void Swarm::add_peer(int peer) {
-    this->peers.push_back(peer);
+std::vector<bool> &Availability::segments_of(int peer) {
+    std::vector<bool> &segments = this->peers[peer];
+    segments.resize(this->segment_cnt, false);
+
+    return segments;
+}
+
+
+void Availability::set(int peer, int idx) {
+    if (idx < 0 || idx >= this->segment_cnt) {
+        return;
+    }
+
+    std::vector<bool> &segments = segments_of(peer);
+    if (!segments[idx]) {
+        segments[idx] = true;
+        this->counts[idx]++;
+
+        if (this->pending != NULL) {
+            this->pending->update(idx, this->counts[idx]);
+        }
+    }
 }
 
 
-void Swarm::remove_peer(int peer) {
-    std::vector<int>::iterator pos = std::find(this->peers.begin(), this->peers.end(), peer);
+void Availability::merge(int peer, const std::vector<uint64_t> &words) {
+    std::vector<bool> &segments = segments_of(peer);
 
-    if (pos != this->peers.end()) {
-        this->peers.erase(pos);
+    for (int idx = 0; idx < this->segment_cnt && idx / 64 < (int) words.size(); idx++) {
+        if ((words[idx / 64] & (1ULL << (idx % 64))) && !segments[idx]) {
+            segments[idx] = true;
+            this->counts[idx]++;
+
+            if (this->pending != NULL) {
+                this->pending->update(idx, this->counts[idx]);
+            }
+        }
     }
 }
 
 
-void Swarm::mark_peer_as_seed(int peer) {
-    this->add_seed(peer);
-    this->remove_peer(peer);
+bool Availability::has(int peer, int idx) const {
+    auto it = this->peers.find(peer);
+    if (it == this->peers.end()) {
+        return false;
+    }
+
+    return idx >= 0 && idx < this->segment_cnt && it->second[idx];
+}
+
+
+ReplicaIndex::ReplicaIndex(int segment_cnt, int ranks) {
+    this->segment_cnt = segment_cnt;
+    this->words_per_segment = (ranks + 63) / 64;
+    this->owners.assign(segment_cnt * this->words_per_segment, 0);
+    this->counts.assign(segment_cnt, 0);
+}
+
+
+void ReplicaIndex::add(int rank, int idx) {
+    if (idx < 0 || idx >= this->segment_cnt || rank / 64 >= this->words_per_segment) {
+        return;
+    }
+
+    uint64_t &word = this->owners[idx * this->words_per_segment + rank / 64];
+    uint64_t mask = 1ULL << (rank % 64);
+
+    if (!(word & mask)) {
+        word |= mask;
+        this->counts[idx]++;
+    }
+}
+
+
+void ReplicaIndex::add_all(int rank) {
+    for (int idx = 0; idx < this->segment_cnt; idx++) {
+        add(rank, idx);
+    }
+}
+
+
+/*
+ * Puts in result at most max_cnt owners of the segment, scanning the ranks
+ * from start (and wrapping around), so different requesters get different
+ * owners.
+ */
+void ReplicaIndex::owners_of(int idx, int start, int max_cnt, std::vector<int> &result) const {
+    result.clear();
+
+    if (idx < 0 || idx >= this->segment_cnt) {
+        return;
+    }
+
+    const uint64_t *words = this->owners.data() + idx * this->words_per_segment;
+    int ranks = this->words_per_segment * 64;
+
+    for (int k = 0; k < ranks && (int) result.size() < max_cnt; k++) {
+        int rank = (start + k) % ranks;
+
+        if (words[rank / 64] & (1ULL << (rank % 64))) {
+            result.push_back(rank);
+        }
+    }
+}
+
+
+/*
+ * Adds a seed, or promotes a peer. Returns false if it already was a seed.
+ */
+bool Swarm::add_seed(int seed) {
+    SwarmRole role = role_of(seed);
+
+    if (role == SwarmRole::SEED) {
+        return false;
+    }
+
+    if (role == SwarmRole::NONE) {
+        insert_member(seed, SwarmRole::SEED);
+    } else {
+        this->roles[seed] = SwarmRole::SEED;
+    }
+
+    log_change(seed, true);
+    return true;
+}
+
+
+/*
+ * Adds a peer. Returns false if it already was a member.
+ */
+bool Swarm::add_peer(int peer) {
+    if (role_of(peer) != SwarmRole::NONE) {
+        return false;
+    }
+
+    insert_member(peer, SwarmRole::PEER);
+    log_change(peer, false);
+    return true;
+}
+
+
+SwarmRole Swarm::role_of(int rank) const {
+    if (rank >= (int) this->roles.size()) {
+        return SwarmRole::NONE;
+    }
+
+    return this->roles[rank];
 }
 
 
 int Swarm::get_size() {
-    return this->seeds.size() + this->peers.size();
+    return this->members.size();
+}
+
+
+void Swarm::insert_member(int rank, SwarmRole role) {
+    if (rank >= (int) this->roles.size()) {
+        this->roles.resize(rank + 1, SwarmRole::NONE);
+    }
+
+    this->roles[rank] = role;
+    this->members.push_back(rank);
+}
+
+
+/*
+ * Puts in result the changes made after known_version. Returns false if
+ * some of them are not in the log anymore.
+ */
+bool Swarm::changes_since(int known_version, std::vector<SwarmChange> &result) {
+    result.clear();
+
+    if (known_version == this->version) {
+        return true;
+    }
+
+    if (this->changes.empty() || this->changes.front().version > known_version + 1) {
+        return false;
+    }
+
+    for (const SwarmChange &change : this->changes) {
+        if (change.version > known_version) {
+            result.push_back(change);
+        }
+    }
+
+    return true;
+}
+
+
+void Swarm::log_change(int rank, bool seed) {
+    this->version++;
+    this->changes.push_back({this->version, rank, seed});
+
+    if (this->changes.size() > SWARM_LOG_SIZE) {
+        this->changes.pop_front();
+    }
+}
+
+
+TokenBucket::TokenBucket(double rate, double burst) {
+    this->rate = rate;
+    this->burst = burst;
+    this->tokens = burst;
+    this->last_time = 0;
+}
+
+
+bool TokenBucket::take(int cnt, double now) {
+    if (this->last_time > 0) {
+        this->tokens = std::min(this->burst, this->tokens + (now - this->last_time) * this->rate);
+    }
+    this->last_time = now;
+
+    if (this->tokens < std::min((double) cnt, this->burst)) {
+        return false;
+    }
+
+    this->tokens -= cnt;
+    return true;
+}
+
+
+double jain_index(const std::vector<double> &values) {
+    double sum = 0;
+    double squares = 0;
+
+    for (double value : values) {
+        sum += value;
+        squares += value * value;
+    }
+
+    if (squares == 0) {
+        return 1;
+    }
+
+    return sum * sum / (values.size() * squares);
+}
+
+
+void index_ranges(const std::vector<int> &indices, std::vector<int> &ranges) {
+    ranges.clear();
+
+    for (int idx : indices) {
+        if (!ranges.empty() && ranges[ranges.size() - 2] + ranges.back() == idx) {
+            ranges.back()++;
+        } else {
+            ranges.push_back(idx);
+            ranges.push_back(1);
+        }
+    }
+}
+
+
+void progress_sends(std::vector<MPI_Request> &requests, std::vector<std::vector<char>> &buffers) {
+    int cnt = requests.size();
+    if (cnt == 0) {
+        return;
+    }
+
+    int done_cnt;
+    std::vector<int> done(cnt);
+    MPI_Testsome(cnt, requests.data(), &done_cnt, done.data(), MPI_STATUSES_IGNORE);
+
+    if (done_cnt == 0 || done_cnt == MPI_UNDEFINED) {
+        return;
+    }
+
+    // Drop the completed requests (now MPI_REQUEST_NULL) and their buffers.
+    int kept = 0;
+    for (int i = 0; i < cnt; i++) {
+        if (requests[i] != MPI_REQUEST_NULL) {
+            requests[kept] = requests[i];
+            std::swap(buffers[kept], buffers[i]);
+            kept++;
+        }
+    }
+
+    requests.resize(kept);
+    buffers.resize(kept);
 }
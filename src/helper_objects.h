@@ -1,33 +1,273 @@
 #ifndef HELPER_OBJECTS_H
 #define HELPER_OBJECTS_H
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <mpi.h>
+#include "constants.h"
 
 
-struct Segment {
-    std::string hash;
-    int index;
+/*
+ * Binary form of a segment hash (32 hex characters -> 16 bytes).
+ * The hex form is only used when parsing the input and when saving a file.
+ */
+struct Digest {
+    uint8_t bytes[DIGEST_SIZE];
+};
+
+bool hex_to_digest(const char *hex, size_t len, Digest &digest);
+
+std::string digest_to_hex(const Digest &digest);
+
+
+/*
+ * Rank of the tracker that owns a file: the file names are partitioned among
+ * the trackers (ranks 0 .. trackers - 1) by a hash that does not depend on
+ * the process.
+ */
+int tracker_of(const std::string &file, int trackers);
+
+/*
+ * Rank of the tracker that owns a file ID. Each tracker numbers the files of
+ * its partition, and the IDs of the trackers are interleaved:
+ * ID = local number * trackers + tracker rank.
+ */
+int tracker_of(int file, int trackers);
+
+
+/*
+ * The segments of a file, kept as a structure of arrays: the i-th segment
+ * has index indices[i] and hash digests[i].
+ */
+class SegmentTable {
+ public:
+    std::vector<int> indices;
+    std::vector<Digest> digests;
+
+    void add(int index, const Digest &digest);
 
-    Segment(std::string hash, int index);
+    void reserve(int cnt);
+
+    int size() const;
 };
 
 
+/*
+ * Possession state of the segments of a file, one bit per segment index.
+ * A single writer sets bits with release stores, while any number of readers
+ * may test them concurrently, without a lock.
+ */
+class Bitfield {
+ public:
+    explicit Bitfield(int size);
+
+    void set(int idx);
+
+    void set_all();
+
+    bool test(int idx) const;
+
+    int get_size() const;
+
+    void snapshot(std::vector<uint64_t> &words) const;
+
+ private:
+    int size;
+    std::vector<std::atomic<uint64_t>> words;
+};
+
+
+/*
+ * The segments of a file not requested yet, bucketed by their number of known
+ * owners, so the rarest ones are found without scanning the others. Adding,
+ * removing and moving a segment to another bucket are O(1) (a removed segment
+ * is swapped with the last one of its bucket). The segments are also kept in
+ * a dense list, for random picks.
+ */
+class PendingSegments {
+ public:
+    explicit PendingSegments(int segment_cnt = 0);
+
+    void add(int idx, int count);
+
+    void remove(int idx);
+
+    void update(int idx, int count);
+
+    bool contains(int idx) const;
+
+    bool empty() const;
+
+    int size() const;
+
+    // The k-th pending segment, in no particular order.
+    int at(int k) const;
+
+    int max_count() const;
+
+    const std::vector<int> &with_count(int count) const;
+
+ private:
+    std::vector<int> members;
+    std::vector<std::vector<int>> buckets;
+
+    // Indexed by segment: its count (-1 if not pending), and its position in
+    // members and in its bucket.
+    std::vector<int> counts;
+    std::vector<int> member_positions;
+    std::vector<int> bucket_positions;
+
+    void unlink(int idx);
+};
+
+
+/*
+ * The segments of a file owned by each known peer, as seen by a downloader.
+ * Filled from BITFIELD replies and HAVE notifications. counts[idx] is the
+ * number of known peers owning segment idx (its replication degree). If
+ * pending is set, its buckets follow the counts.
+ */
+class Availability {
+ public:
+    int segment_cnt;
+    std::unordered_map<int, std::vector<bool>> peers;
+    std::vector<int> counts;
+    PendingSegments *pending;
+
+    explicit Availability(int segment_cnt = 0);
+
+    void set(int peer, int idx);
+
+    void merge(int peer, const std::vector<uint64_t> &words);
+
+    bool has(int peer, int idx) const;
+
+ private:
+    std::vector<bool> &segments_of(int peer);
+};
+
+
+/*
+ * The owners of each segment of a file, kept by the tracker when the replica
+ * index is on: one bit per rank for each segment (owners of segment idx in
+ * the words [idx * words_per_segment, (idx + 1) * words_per_segment)), plus
+ * the replica count of each segment.
+ */
+class ReplicaIndex {
+ public:
+    int segment_cnt;
+    int words_per_segment;
+    std::vector<uint64_t> owners;
+    std::vector<int> counts;
+
+    ReplicaIndex(int segment_cnt = 0, int ranks = 0);
+
+    void add(int rank, int idx);
+
+    void add_all(int rank);
+
+    void owners_of(int idx, int start, int max_cnt, std::vector<int> &result) const;
+};
+
+
+// A join (seed = false) or a promotion to seed (seed = true) in a swarm.
+struct SwarmChange {
+    int version;
+    int rank;
+    bool seed;
+};
+
+
+// Role of a client in the swarm of a file.
+enum class SwarmRole : uint8_t {
+    NONE,
+    PEER,
+    SEED
+};
+
+
+/*
+ * The members of the swarm of a file: a dense list of their ranks, plus the
+ * role of each rank. Adding and promoting a member are O(1), and a rank is
+ * never listed twice. A member never leaves.
+ *
+ * Every change increments the version and is kept in a bounded log, so a
+ * client that knows an older version can be sent only what changed since then.
+ */
 class Swarm {
  public:
-    std::vector<int> seeds;
-    std::vector<int> peers;
+    std::vector<int> members;
+
+    int version = 0;
+    std::deque<SwarmChange> changes;
 
-    void add_seed(int seed);
+    // Downloaders told about a change that have not asked for it yet, so
+    // they are not told again.
+    std::unordered_set<int> notified;
 
-    void add_peer(int peer);
+    bool add_seed(int seed);
 
-    void remove_peer(int peer);
+    bool add_peer(int peer);
 
-    void mark_peer_as_seed(int peer);
+    SwarmRole role_of(int rank) const;
 
     int get_size();
+
+    bool changes_since(int known_version, std::vector<SwarmChange> &result);
+
+ private:
+    // Indexed by rank.
+    std::vector<SwarmRole> roles;
+
+    void insert_member(int rank, SwarmRole role);
+
+    void log_change(int rank, bool seed);
 };
 
 
+/*
+ * Upload rate limit: tokens (segments) are refilled at rate per second, up to
+ * burst. A request is let through when the tokens cover it, or cover the whole
+ * burst if it is larger; it may then leave the bucket in debt.
+ */
+class TokenBucket {
+ public:
+    TokenBucket(double rate = 0, double burst = 0);
+
+    bool take(int cnt, double now);
+
+ private:
+    double rate;
+    double burst;
+    double tokens;
+    double last_time;
+};
+
+
+/*
+ * Jain's fairness index of the values: 1 when they are all equal, down to
+ * 1 / n when a single one takes everything (1 for no values).
+ */
+double jain_index(const std::vector<double> &values);
+
+
+/*
+ * Puts in ranges the (first index, count) pairs of the runs of consecutive
+ * values in indices (sorted).
+ */
+void index_ranges(const std::vector<int> &indices, std::vector<int> &ranges);
+
+
+/*
+ * Completes whichever of the sends (each with its own buffer, at the same
+ * index) are done, without blocking, and drops them with their buffers.
+ */
+void progress_sends(std::vector<MPI_Request> &requests, std::vector<std::vector<char>> &buffers);
+
+
 #endif /* HELPER_OBJECTS_H */
@@ -1,33 +1,44 @@
-#include <mpi.h>
-#include <stdio.h>
-#include <stdlib.h>
-
-#include "Tracker.h"
-#include "Client.h"
-#include "constants.h"
-
-
-int main (int argc, char *argv[]) {
-    int numtasks, rank;
-
-    int provided;
-    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
-    if (provided < MPI_THREAD_MULTIPLE) {
-        fprintf(stderr, "MPI nu are suport pentru multi-threading\n");
-        exit(-1);
-    }
-    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-
-    if (rank == TRACKER_RANK) {
-        Tracker *tracker = new Tracker(numtasks, rank);
-        tracker->run();
-        delete tracker;
-    } else {
-        Client *client = new Client(numtasks, rank);
-        client->run();
-        delete client;
-    }
-
-    MPI_Finalize();
-}
+#include <mpi.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Tracker.h"
+#include "Client.h"
+#include "constants.h"
+
+
+int main (int argc, char *argv[]) {
+    int numtasks, rank;
+
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    if (provided < MPI_THREAD_MULTIPLE) {
+        fprintf(stderr, "MPI nu are suport pentru multi-threading\n");
+        exit(-1);
+    }
+    MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    // The number of trackers is read the same way by all the tasks.
+    int trackers = TRACKERS;
+    if (getenv("BT_TRACKERS") != NULL) {
+        trackers = atoi(getenv("BT_TRACKERS"));
+    }
+
+    if (trackers < 1 || trackers >= numtasks) {
+        fprintf(stderr, "Numar invalid de trackere: %d\n", trackers);
+        exit(-1);
+    }
+
+    if (rank < trackers) {
+        Tracker *tracker = new Tracker(numtasks, rank, trackers);
+        tracker->run();
+        delete tracker;
+    } else {
+        Client *client = new Client(numtasks, rank, trackers);
+        client->run();
+        delete client;
+    }
+
+    MPI_Finalize();
+}
@@ -0,0 +1,107 @@
+#include "md5.h"
+#include "md5_lanes.h"
+
+using namespace std;
+
+
+// One lane: the portable kernel, also used for single buffers.
+struct Scalar {
+    typedef uint32_t vec;
+    static const int LANES = 1;
+
+    static vec set1(uint32_t x) { return x; }
+    static vec load(const uint32_t *p) { return *p; }
+    static void store(uint32_t *p, vec x) { *p = x; }
+    static vec add(vec x, vec y) { return x + y; }
+    static vec and_(vec x, vec y) { return x & y; }
+    static vec or_(vec x, vec y) { return x | y; }
+    static vec xor_(vec x, vec y) { return x ^ y; }
+    static vec andnot(vec x, vec y) { return ~x & y; }
+    static vec not_(vec x) { return ~x; }
+    static vec rotl(vec x, int n) { return (x << n) | (x >> (32 - n)); }
+};
+
+
+static void md5_multi_scalar(const uint8_t *const *data, size_t len, Digest *digests) {
+    md5_lanes_blocks<Scalar>(data, len, digests);
+}
+
+
+struct Md5Kernel {
+    const char *name;
+    int lanes;
+    void (*hash)(const uint8_t *const *data, size_t len, Digest *digests);
+};
+
+
+static Md5Kernel select_kernel() {
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f")) {
+        return {"avx512", 16, md5_multi_avx512};
+    }
+
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", 8, md5_multi_avx2};
+    }
+
+    return {"scalar", 1, md5_multi_scalar};
+}
+
+
+// Chosen once, on first use (thread-safe static initialization).
+static const Md5Kernel &kernel() {
+    static const Md5Kernel selected = select_kernel();
+    return selected;
+}
+
+
+void md5(const uint8_t *data, size_t len, Digest &digest) {
+    md5_multi_scalar(&data, len, &digest);
+}
+
+
+void md5_multi(const uint8_t *const *data, size_t len, Digest *digests, int cnt) {
+    const Md5Kernel &k = kernel();
+
+    for (int start = 0; start < cnt; start += k.lanes) {
+        int group = min(k.lanes, cnt - start);
+
+        if (group == k.lanes) {
+            k.hash(data + start, len, digests + start);
+            continue;
+        }
+
+        // A partial group: a few buffers are hashed one by one, more fill the
+        // unused lanes with the first buffer of the group.
+        if (group <= k.lanes / 4) {
+            for (int i = start; i < cnt; i++) {
+                md5(data[i], len, digests[i]);
+            }
+            break;
+        }
+
+        const uint8_t *lane_data[MD5_MAX_LANES];
+        Digest lane_digests[MD5_MAX_LANES];
+
+        for (int i = 0; i < k.lanes; i++) {
+            lane_data[i] = data[start + (i < group ? i : 0)];
+        }
+
+        k.hash(lane_data, len, lane_digests);
+
+        for (int i = 0; i < group; i++) {
+            digests[start + i] = lane_digests[i];
+        }
+    }
+}
+
+
+int md5_lanes() {
+    return kernel().lanes;
+}
+
+
+const char *md5_kernel_name() {
+    return kernel().name;
+}
@@ -0,0 +1,39 @@
+#ifndef MD5_H
+#define MD5_H
+
+#include <cstddef>
+#include <cstdint>
+#include "helper_objects.h"
+
+
+// Maximum number of buffers hashed at once by md5_multi.
+#define MD5_MAX_LANES 16
+
+
+/*
+ * MD5 of a single buffer.
+ */
+void md5(const uint8_t *data, size_t len, Digest &digest);
+
+/*
+ * MD5 of cnt buffers of the same length, hashed side by side in the lanes of
+ * the widest kernel the CPU supports (AVX-512, AVX2 or scalar, chosen once at
+ * run time). cnt is at most MD5_MAX_LANES.
+ */
+void md5_multi(const uint8_t *const *data, size_t len, Digest *digests, int cnt);
+
+/*
+ * Number of lanes (buffers hashed at once) of the kernel in use.
+ */
+int md5_lanes();
+
+const char *md5_kernel_name();
+
+
+// Kernels, each in its own file compiled for its instruction set.
+void md5_multi_avx2(const uint8_t *const *data, size_t len, Digest *digests);
+
+void md5_multi_avx512(const uint8_t *const *data, size_t len, Digest *digests);
+
+
+#endif /* MD5_H */
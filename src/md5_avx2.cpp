@@ -0,0 +1,32 @@
+/*
+ * 8-lane MD5 kernel. This file is compiled with -mavx2 and only called when
+ * the CPU supports AVX2.
+ */
+#include <immintrin.h>
+#include "md5_lanes.h"
+
+
+struct Avx2 {
+    typedef __m256i vec;
+    static const int LANES = 8;
+
+    static vec set1(uint32_t x) { return _mm256_set1_epi32(x); }
+    static vec load(const uint32_t *p) { return _mm256_load_si256((const __m256i *) p); }
+    static void store(uint32_t *p, vec x) { _mm256_store_si256((__m256i *) p, x); }
+    static vec add(vec x, vec y) { return _mm256_add_epi32(x, y); }
+    static vec and_(vec x, vec y) { return _mm256_and_si256(x, y); }
+    static vec or_(vec x, vec y) { return _mm256_or_si256(x, y); }
+    static vec xor_(vec x, vec y) { return _mm256_xor_si256(x, y); }
+    static vec andnot(vec x, vec y) { return _mm256_andnot_si256(x, y); }
+    static vec not_(vec x) { return _mm256_xor_si256(x, _mm256_set1_epi32(-1)); }
+
+    static vec rotl(vec x, int n) {
+        return _mm256_or_si256(_mm256_sllv_epi32(x, _mm256_set1_epi32(n)),
+                               _mm256_srlv_epi32(x, _mm256_set1_epi32(32 - n)));
+    }
+};
+
+
+void md5_multi_avx2(const uint8_t *const *data, size_t len, Digest *digests) {
+    md5_lanes_blocks<Avx2>(data, len, digests);
+}
@@ -0,0 +1,32 @@
+/*
+ * 16-lane MD5 kernel. This file is compiled with -mavx512f and only called
+ * when the CPU supports AVX-512F.
+ */
+// Optimized, GCC warns about the undefined register that the unmasked
+// AVX-512 intrinsics start from, inside its own headers.
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#include "md5_lanes.h"
+
+
+struct Avx512 {
+    typedef __m512i vec;
+    static const int LANES = 16;
+
+    static vec set1(uint32_t x) { return _mm512_set1_epi32(x); }
+    static vec load(const uint32_t *p) { return _mm512_load_si512(p); }
+    static void store(uint32_t *p, vec x) { _mm512_store_si512(p, x); }
+    static vec add(vec x, vec y) { return _mm512_add_epi32(x, y); }
+    static vec and_(vec x, vec y) { return _mm512_and_si512(x, y); }
+    static vec or_(vec x, vec y) { return _mm512_or_si512(x, y); }
+    static vec xor_(vec x, vec y) { return _mm512_xor_si512(x, y); }
+    static vec andnot(vec x, vec y) { return _mm512_andnot_si512(x, y); }
+    static vec not_(vec x) { return _mm512_xor_si512(x, _mm512_set1_epi32(-1)); }
+    static vec rotl(vec x, int n) { return _mm512_rolv_epi32(x, _mm512_set1_epi32(n)); }
+};
+
+
+void md5_multi_avx512(const uint8_t *const *data, size_t len, Digest *digests) {
+    md5_lanes_blocks<Avx512>(data, len, digests);
+}
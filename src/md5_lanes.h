@@ -0,0 +1,125 @@
+#ifndef MD5_LANES_H
+#define MD5_LANES_H
+
+#include <cstring>
+#include "md5.h"
+
+
+/*
+ * Multi-buffer MD5, shared by the SIMD kernels: V::LANES buffers of the same
+ * length are hashed at once, lane i of every vector working on buffer i.
+ * V provides the vector type and its 32-bit lane operations; this header is
+ * included by a file compiled for the instruction set of V.
+ */
+
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const int MD5_S[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+
+template <class V>
+static void md5_lanes_blocks(const uint8_t *const *data, size_t len, Digest *digests) {
+    typedef typename V::vec vec;
+    const int lanes = V::LANES;
+
+    // The padding is the same for all the buffers (same length): the full
+    // blocks are read in place, the last one or two from a padded copy.
+    size_t full_blocks = len / 64;
+    size_t tail_len = len % 64;
+    size_t tail_blocks = tail_len < 56 ? 1 : 2;
+
+    alignas(64) uint8_t tails[MD5_MAX_LANES][128];
+    uint64_t bit_len = (uint64_t) len * 8;
+
+    for (int lane = 0; lane < lanes; lane++) {
+        memset(tails[lane], 0, sizeof(tails[lane]));
+        memcpy(tails[lane], data[lane] + full_blocks * 64, tail_len);
+        tails[lane][tail_len] = 0x80;
+        memcpy(tails[lane] + tail_blocks * 64 - 8, &bit_len, 8);
+    }
+
+    vec a = V::set1(0x67452301);
+    vec b = V::set1(0xefcdab89);
+    vec c = V::set1(0x98badcfe);
+    vec d = V::set1(0x10325476);
+
+    alignas(64) uint32_t words[16][MD5_MAX_LANES];
+
+    for (size_t block = 0; block < full_blocks + tail_blocks; block++) {
+        // Transpose: word j of every lane in words[j].
+        for (int lane = 0; lane < lanes; lane++) {
+            const uint8_t *src = block < full_blocks ? data[lane] + block * 64
+                                                     : tails[lane] + (block - full_blocks) * 64;
+
+            for (int j = 0; j < 16; j++) {
+                memcpy(&words[j][lane], src + 4 * j, 4);
+            }
+        }
+
+        vec m[16];
+        for (int j = 0; j < 16; j++) {
+            m[j] = V::load(words[j]);
+        }
+
+        vec aa = a, bb = b, cc = c, dd = d;
+
+        for (int i = 0; i < 64; i++) {
+            vec f;
+            int g;
+
+            if (i < 16) {
+                f = V::or_(V::and_(bb, cc), V::andnot(bb, dd));
+                g = i;
+            } else if (i < 32) {
+                f = V::or_(V::and_(dd, bb), V::andnot(dd, cc));
+                g = (5 * i + 1) % 16;
+            } else if (i < 48) {
+                f = V::xor_(V::xor_(bb, cc), dd);
+                g = (3 * i + 5) % 16;
+            } else {
+                f = V::xor_(cc, V::or_(bb, V::not_(dd)));
+                g = (7 * i) % 16;
+            }
+
+            f = V::add(V::add(f, aa), V::add(V::set1(MD5_K[i]), m[g]));
+            aa = dd;
+            dd = cc;
+            cc = bb;
+            bb = V::add(bb, V::rotl(f, MD5_S[i]));
+        }
+
+        a = V::add(a, aa);
+        b = V::add(b, bb);
+        c = V::add(c, cc);
+        d = V::add(d, dd);
+    }
+
+    alignas(64) uint32_t state[4][MD5_MAX_LANES];
+    V::store(state[0], a);
+    V::store(state[1], b);
+    V::store(state[2], c);
+    V::store(state[3], d);
+
+    for (int lane = 0; lane < lanes; lane++) {
+        for (int k = 0; k < 4; k++) {
+            memcpy(digests[lane].bytes + 4 * k, &state[k][lane], 4);
+        }
+    }
+}
+
+
+#endif /* MD5_LANES_H */